@@ -0,0 +1,18 @@
+#version 430 core
+
+in vec2 TexCoords;
+in vec4	VertColor;
+
+out vec4 	FragColor;
+
+// Single channel distance field, the glyph edge being at 0.5
+uniform sampler2D Image;
+
+void main()
+{
+	float distance = texture(Image, TexCoords).r;
+	float width = fwidth(distance);
+	float alpha = smoothstep(0.5 - width, 0.5 + width, distance);
+
+	FragColor = vec4(1.0, 1.0, 1.0, alpha) * VertColor;
+}
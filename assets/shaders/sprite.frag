@@ -1,13 +1,42 @@
 #version 430 core
 
+// Matches SpriteBatch::TemplateFlags
+#define TEMPLATE_ALPHA_FROM_RED		1u
+#define TEMPLATE_DISTANCE_FIELD		2u
+
 in vec2 TexCoords;
 in vec4	VertColor;
 
 out vec4 	FragColor;
 
+#ifdef MULTI_DRAW
+
+flat in uint Layer;
+flat in uint Flags;
+
+uniform sampler2DArray Image;
+
+void main()
+{
+	vec4 TexColor = texture(Image, vec3(TexCoords, float(Layer)));
+	if ((Flags & TEMPLATE_ALPHA_FROM_RED) != 0u) {
+		TexColor.a = TexColor.r;
+	}
+	else if ((Flags & TEMPLATE_DISTANCE_FIELD) != 0u) {
+		float width = fwidth(TexColor.r);
+		TexColor = vec4(1.0, 1.0, 1.0, smoothstep(0.5 - width, 0.5 + width, TexColor.r));
+	}
+
+	FragColor = TexColor * VertColor;
+}
+
+#else
+
 uniform sampler2D Image;
 
 void main()
 {    
     FragColor = texture(Image, TexCoords) *  VertColor;
-}
\ No newline at end of file
+}
+
+#endif
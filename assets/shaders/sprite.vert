@@ -4,10 +4,30 @@
 #define UBO_TEMPLATE	1
 #define UBO_INSTANCE	2
 #define UBO_DATA		3
+#define UBO_TWEEN		4
+
+#define TIME_LOCATION	0
 
 #define MAX_VERTICES	6
+
+// The sprite batch injects its own sizes
+#ifndef MAX_TEMPLATES
 #define MAX_TEMPLATES 	256
+#endif
+
+#ifndef MAX_INSTANCES
 #define MAX_INSTANCES 	256
+#endif
+
+// Number of 32 bits words of a compact model, and of its tween
+#define COMPACT_WORDS	5
+#define TWEEN_WORDS		8
+
+// Matches SpriteBatch::Easing
+#define EASE_LINEAR		0u
+#define EASE_IN			1u
+#define EASE_OUT		2u
+#define EASE_IN_OUT		3u
 
 precision highp float;
 
@@ -29,28 +49,122 @@ layout(binding = UBO_TEMPLATE) uniform Template
 	Vertex	Vertices[MAX_TEMPLATES];
 } Templates;
 
+// Four words keep the stride at 16 bytes for std140 and std430 alike
 struct Sprite
 {
 	uint	TemplateID;
 	uint	DataID;
+	uint	Layer;
+	uint	Flags;
 };
 
-layout(binding = UBO_INSTANCE) uniform Instance
+// Storage buffers are unsized, and can grow along with the batch
+#ifdef STORAGE_BUFFERS
+#define INSTANCE_BLOCK	readonly buffer
+#define INSTANCE_COUNT
+#else
+#define INSTANCE_BLOCK	uniform
+#define INSTANCE_COUNT	MAX_INSTANCES
+#endif
+
+layout(binding = UBO_INSTANCE) INSTANCE_BLOCK Instance
 {
-	Sprite Sprites[MAX_INSTANCES];
+	Sprite Sprites[INSTANCE_COUNT];
 } Instances;
 
+#ifdef COMPACT_DATA
+
+// Position (2 floats), scale (half2), rotation (float) and colour (RGBA8),
+// tightly packed. std140 pads scalar arrays to 16 bytes, hence the models
+// are stored as a flat array of words.
+#ifdef STORAGE_BUFFERS
+
+layout(binding = UBO_DATA) readonly buffer Datum
+{
+	uint Words[];
+} Data;
+
+uint fetchWord(uint index)
+{
+	return Data.Words[index];
+}
+
+layout(binding = UBO_TWEEN) readonly buffer Tween
+{
+	uint Words[];
+} Tweens;
+
+uint fetchTweenWord(uint index)
+{
+	return Tweens.Words[index];
+}
+
+#else
+
+layout(binding = UBO_DATA) uniform Datum
+{
+	uvec4 Words[(MAX_INSTANCES * COMPACT_WORDS + 3) / 4];
+} Data;
+
+uint fetchWord(uint index)
+{
+	return Data.Words[index >> 2][index & 3];
+}
+
+layout(binding = UBO_TWEEN) uniform Tween
+{
+	uvec4 Words[MAX_INSTANCES * TWEEN_WORDS / 4];
+} Tweens;
+
+uint fetchTweenWord(uint index)
+{
+	return Tweens.Words[index >> 2][index & 3];
+}
+
+#endif
+
+// Tweens hold the end state, encoded as the model, start time, duration and
+// easing. They are evaluated against the batch time, the model being the start.
+layout(location = TIME_LOCATION) uniform float Time;
+
+float ease(float t, uint easing)
+{
+	switch (easing)
+	{
+	case EASE_IN:
+		return t * t;
+	case EASE_OUT:
+		return t * (2.0 - t);
+	case EASE_IN_OUT:
+		return t < 0.5 ? 2.0 * t * t : -1.0 + (4.0 - 2.0 * t) * t;
+	default:
+		return t;
+	}
+}
+
+#else
+
 struct Model
 {
 	mat4 Transform;
 	vec4 Color;
 };
 
-layout(binding = UBO_DATA) uniform Datum
+layout(binding = UBO_DATA) INSTANCE_BLOCK Datum
 {
-	Model Models[MAX_INSTANCES];
+	Model Models[INSTANCE_COUNT];
 } Data;
 
+#endif
+
+#ifdef MULTI_DRAW
+// Instanced attribute, offset by the base instance of each draw command
+layout(location = 0) in uint DrawID;
+
+flat out uint Layer;
+flat out uint Flags;
+#endif
+
 out vec2 TexCoords;
 out vec4 VertColor;
 
@@ -61,13 +175,55 @@ out gl_PerVertex
 
 void main()
 {
+#ifdef MULTI_DRAW
+	Sprite sprite = Instances.Sprites[DrawID];
+	Layer = sprite.Layer;
+	Flags = sprite.Flags;
+#else
 	Sprite sprite = Instances.Sprites[gl_InstanceID];
-	Model model = Data.Models[sprite.DataID];
+#endif
 	vec4 vertex = Templates.Vertices[sprite.TemplateID].XYUV[gl_VertexID % MAX_VERTICES];
-	
+
+#ifdef COMPACT_DATA
+	uint base = sprite.DataID * COMPACT_WORDS;
+	vec2 position = vec2(uintBitsToFloat(fetchWord(base)), uintBitsToFloat(fetchWord(base + 1)));
+	vec2 scale = unpackHalf2x16(fetchWord(base + 2));
+	float rotation = uintBitsToFloat(fetchWord(base + 3));
+	vec4 color = unpackUnorm4x8(fetchWord(base + 4));
+
+	// A zero duration means no tween
+	uint tween = sprite.DataID * TWEEN_WORDS;
+	float duration = uintBitsToFloat(fetchTweenWord(tween + 6));
+	if (duration > 0.0)
+	{
+		float start_time = uintBitsToFloat(fetchTweenWord(tween + 5));
+		float t = ease(clamp((Time - start_time) / duration, 0.0, 1.0), fetchTweenWord(tween + 7));
+
+		position = mix(position, vec2(uintBitsToFloat(fetchTweenWord(tween)), uintBitsToFloat(fetchTweenWord(tween + 1))), t);
+		scale = mix(scale, unpackHalf2x16(fetchTweenWord(tween + 2)), t);
+		rotation = mix(rotation, uintBitsToFloat(fetchTweenWord(tween + 3)), t);
+		color = mix(color, unpackUnorm4x8(fetchTweenWord(tween + 4)), t);
+	}
+
+	// Same as the CPU side transform, scale, then rotate around the centre
+	vec2 centre = 0.5 * scale;
+	vec2 local = vertex.xy * scale - centre;
+	float c = cos(rotation);
+	float s = sin(rotation);
+	vec2 world = position + centre + vec2(c * local.x - s * local.y, s * local.x + c * local.y);
+
+	// To fragment shader
+	VertColor = color;
+	TexCoords = vertex.zw;
+
+	gl_Position = Projection.Ortho * vec4(world, 0.0, 1.0);
+#else
+	Model model = Data.Models[sprite.DataID];
+
 	// To fragment shader
 	VertColor = model.Color;
 	TexCoords = vertex.zw;
-	
+
 	gl_Position = Projection.Ortho * model.Transform * vec4(vertex.xy, 0.0, 1.0);
+#endif
 }
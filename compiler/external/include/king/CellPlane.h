@@ -0,0 +1,126 @@
+#pragma once
+
+#include <cstdint>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define KING_PLANE_SSE2
+#endif
+
+namespace King {
+
+	// Boards are planes of bytes, one per cell, row-major, index row * width + column.
+	// Runs are found by comparing each cell with the ones following it along its row,
+	// or its column, as many cells at once as a vector register holds.
+
+	struct ScalarPlaneLanes {
+		typedef uint8_t Vector;
+		static const int32_t CELLS = 1;
+
+		static Vector Load(const uint8_t* cells) { return *cells; }
+		static void Store(uint8_t* cells, Vector v) { *cells = v; }
+		static Vector Equal(Vector a, Vector b) { return a == b ? 0xff : 0x00; }
+		static Vector And(Vector a, Vector b) { return a & b; }
+		static Vector Or(Vector a, Vector b) { return a | b; }
+		static bool IsZero(Vector v) { return v == 0; }
+	};
+
+#if defined(__AVX2__)
+	struct VectorPlaneLanes {
+		typedef __m256i Vector;
+		static const int32_t CELLS = 32;
+
+		static Vector Load(const uint8_t* cells) { return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(cells)); }
+		static void Store(uint8_t* cells, Vector v) { _mm256_storeu_si256(reinterpret_cast<__m256i*>(cells), v); }
+		static Vector Equal(Vector a, Vector b) { return _mm256_cmpeq_epi8(a, b); }
+		static Vector And(Vector a, Vector b) { return _mm256_and_si256(a, b); }
+		static Vector Or(Vector a, Vector b) { return _mm256_or_si256(a, b); }
+		static bool IsZero(Vector v) { return _mm256_testz_si256(v, v) != 0; }
+	};
+#elif defined(KING_PLANE_SSE2)
+	struct VectorPlaneLanes {
+		typedef __m128i Vector;
+		static const int32_t CELLS = 16;
+
+		static Vector Load(const uint8_t* cells) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(cells)); }
+		static void Store(uint8_t* cells, Vector v) { _mm_storeu_si128(reinterpret_cast<__m128i*>(cells), v); }
+		static Vector Equal(Vector a, Vector b) { return _mm_cmpeq_epi8(a, b); }
+		static Vector And(Vector a, Vector b) { return _mm_and_si128(a, b); }
+		static Vector Or(Vector a, Vector b) { return _mm_or_si128(a, b); }
+		static bool IsZero(Vector v) { return _mm_movemask_epi8(v) == 0; }
+	};
+#else
+	typedef ScalarPlaneLanes VectorPlaneLanes;
+#endif
+
+	// Marks the runs starting at the cells of a vector, the following cells
+	// of a run being step bytes apart. False if none starts there.
+	template <class Lanes>
+	inline bool MarkPlaneRuns(const uint8_t* colours, const uint8_t* matchable, uint8_t* matched, int32_t step, int32_t length) {
+		const typename Lanes::Vector first = Lanes::Load(colours);
+		typename Lanes::Vector runs = Lanes::Load(matchable);
+		for (int32_t i = 1; i < length; ++i) {
+			runs = Lanes::And(runs, Lanes::And(
+				Lanes::Equal(first, Lanes::Load(colours + i * step)),
+				Lanes::Load(matchable + i * step)));
+		}
+
+		if (Lanes::IsZero(runs)) {
+			return false;
+		}
+
+		for (int32_t i = 0; i < length; ++i) {
+			uint8_t* cells = matched + i * step;
+			Lanes::Store(cells, Lanes::Or(Lanes::Load(cells), runs));
+		}
+
+		return true;
+	}
+
+	// Same, for count consecutive cells, vectors first and single cells for the rest
+	inline bool MarkPlaneSpanRuns(const uint8_t* colours, const uint8_t* matchable, uint8_t* matched,
+		int32_t count, int32_t step, int32_t length) {
+
+		bool found = false;
+		int32_t c = 0;
+		for (; c + VectorPlaneLanes::CELLS <= count; c += VectorPlaneLanes::CELLS) {
+			found |= MarkPlaneRuns<VectorPlaneLanes>(colours + c, matchable + c, matched + c, step, length);
+		}
+
+		for (; c < count; ++c) {
+			found |= MarkPlaneRuns<ScalarPlaneLanes>(colours + c, matchable + c, matched + c, step, length);
+		}
+
+		return found;
+	}
+
+	// Sets to 0xff, in matched, the cells of runs of at least length cells along
+	// rows and columns, of the same colour and all matchable, 0xff in matchable,
+	// 0x00 otherwise. The other cells of matched are left as they are.
+	// True if any run was found.
+	inline bool FindPlaneRuns(const uint8_t* colours, const uint8_t* matchable, uint8_t* matched,
+		int32_t width, int32_t height, int32_t length) {
+
+		bool found = false;
+
+		// Runs start far enough from the end of their row, never wrapping into the next
+		if (length <= width) {
+			for (int32_t y = 0; y < height; ++y) {
+				const int32_t row = y * width;
+				found |= MarkPlaneSpanRuns(colours + row, matchable + row, matched + row,
+					width - length + 1, 1, length);
+			}
+		}
+
+		// Whole rows of columns at once
+		for (int32_t y = 0; y + length <= height; ++y) {
+			const int32_t row = y * width;
+			found |= MarkPlaneSpanRuns(colours + row, matchable + row, matched + row,
+				width, width, length);
+		}
+
+		return found;
+	}
+}
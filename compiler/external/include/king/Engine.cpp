@@ -4,6 +4,12 @@
 #include <algorithm>
 #include <vector>
 #include <array>
+#include <string>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 #define GLM_FORCE_RADIANS 
 #include <glm/gtc/matrix_transform.hpp>
@@ -11,6 +17,7 @@
 #include <glm/glm.hpp>
 #include <sdl/Sdl.h>
 
+#include "CellPlane.h"
 #include "Font.h"
 #include "GlContext.h"
 #include "Sdl.h"
@@ -18,115 +25,389 @@
 #include "SdlSurface.h"
 #include "Updater.h"
 
+#include "Profiler.hpp"
 #include "SpriteBatch.hpp"
 #include "SpriteTexture.hpp"
+#include "SpriteTextureArray.hpp"
 
 namespace King {
 	static const int WindowWidth = 800;
 	static const int WindowHeight = 600;
-	static const float MaxFrameTicks = 300.0f;
-	static const float TextScale = 0.5f;
+	static const uint64_t MaxFrameNanoseconds = 300000000ull;
 
 	static const float CellScale = 1.0f;
 	static const float DiamondScale = 1.0f;
 	static const float CharSpacing = 1.1f;
+
+	// Moving diamonds are drawn on top of the resting ones
+	static const uint16_t RestingDiamondDepth = 0;
+	static const uint16_t MovingDiamondDepth = 1;
 	
-	const static size_t GRID_DIM = 8;
+	// Sprites are streamed through persistently mapped buffers,
+	// in compact form, as all of them are 2D quads.
+	static const SpriteBatch::UploadMode BatchUploadMode = SpriteBatch::eUM_PERSISTENT_RING;
+	static const SpriteBatch::InstanceFormat BatchInstanceFormat = SpriteBatch::eIF_COMPACT;
+	static const SpriteBatch::BufferBackend BatchBufferBackend = SpriteBatch::eBB_STORAGE;
+
+	// All the images share one batch, and one texture array, so
+	// that the whole frame is submitted with a single draw call.
+	static const bool MergeBatches = true;
+
+	// Sprites outside of the window are neither uploaded nor drawn
+	static const SpriteBatch::CullMode BatchCullMode = SpriteBatch::eCM_CPU;
+
+	// With a fixed timestep the updater runs in steps of FixedStepNanoseconds,
+	// as many as the frame time accumulated, and the frame is rendered in between
+	// the last two. A frame runs MaxCatchUpSteps at most, any time left over is
+	// dropped, so a stall slows the game down rather than stalling it further.
+	// Otherwise the updater runs once per frame, by the frame time.
+	static const uint64_t FixedStepNanoseconds = 1000000000ull / 120;
+	static const uint32_t MaxCatchUpSteps = 8;
+
+	// With a render thread, the context is owned by it, and it draws the frames
+	// the main thread has built, while the main thread goes on with the next.
+	// Frames are handed over as packets of the batch uploads, and it can
+	// be RenderQueueFrames frames behind at most.
+	static const uint32_t RenderQueueFrames = 3;
+
+	// Input events kept between two updates, the oldest are dropped beyond
+	static const size_t MaxInputEvents = 256;
+
+	// Rendering on demand, the updater still runs this often at least, as
+	// its timers would otherwise stop. Shorter than the catch up budget,
+	// so that no time gets dropped.
+	static const uint32_t IdleWaitMilliseconds = 50;
+	static_assert(IdleWaitMilliseconds * 1000000ull < MaxCatchUpSteps * FixedStepNanoseconds,
+		"Idle waits would drop simulation time");
+
+	// Text is drawn from the distance field atlas generated by the SdfFont
+	// tool, which stays sharp at any size, rather than from the bitmap one.
+	static const bool DistanceFieldFont = true;
+
+	// Largest side of the board, its cells are about half a pixel wide by then
+	static const int32_t MaxGridDim = 1024;
+
 	const static size_t MAX_GLYPHS = 256;
-	const static size_t MAX_CHARS = 256;
+
+	// Templates each image batch holds, when not merged
+	size_t GetMaxTemplates(size_t image) {
+		switch (image) {
+		case Engine::IMAGE_BACKGROUND:
+			return 4;
+		case Engine::IMAGE_DIAMONDS:
+			return 8;
+		case Engine::IMAGE_TEXT:
+			return MAX_GLYPHS;
+		default:
+			return SpriteBatch::MAX_TEMPLATES;
+		}
+	}
+
+	// Write draws from a pool of glyph instances, grown a page at a time.
+	// Pages no frame wrote to within the last GLYPH_PAGE_IDLE_FRAMES are released.
+	const static size_t GLYPH_PAGE_SIZE = 64;
+	const static size_t GLYPH_PAGE_IDLE_FRAMES = 120;
+	const static size_t GLYPH_RUN_CACHE_SIZE = 64;
+
+	// Glyphs of a string laid out at a size of 1, so that a run serves any size
+	struct GlyphRun {
+		struct Placement {
+			float mOffset;
+			glm::vec2 mSize;
+		};
+
+		size_t mHash = 0;
+		std::string mText;
+		std::vector<Placement> mGlyphs;
+		float mWidth = 0.f;
+	};
+
+	// Monotonic, whatever the wall clock does
+	uint64_t ClockNanoseconds() {
+		return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count());
+	}
+
+	float NanosecondsToSeconds(uint64_t nanoseconds) {
+		return float(double(nanoseconds) * 1e-9);
+	}
+
+	// FNV-1a
+	size_t HashString(const char* text, size_t length) {
+		uint64_t hash = 14695981039346656037ull;
+		for (size_t c = 0; c < length; ++c) {
+			hash = (hash ^ uint8_t(text[c])) * 1099511628211ull;
+		}
+		return size_t(hash);
+	}
 
 	struct Engine::Implementation {
 		
 		Sdl mSdl;
-		SdlWindow mSdlWindow;
-		GlContext mGlContext;
+		Engine::Backend mBackend;
+
+		// Neither exists with the null backend
+		std::unique_ptr<SdlWindow> mSdlWindow;
+		std::unique_ptr<GlContext> mGlContext;
+
+		// Colour and depth renderbuffers of the offscreen backend
+		uint32_t mOffscreenFramebuffer;
+		uint32_t mOffscreenRenderbuffers[2];
 
 		std::unique_ptr<SpriteTexture> mTextures[Engine::IMAGE_MAX];
-		std::unique_ptr<SpriteBatch> mBatches[Engine::IMAGE_MAX];
+		std::unique_ptr<SpriteTextureArray> mTextureArray;
+
+		// Images point to the same batch when merged
+		std::shared_ptr<SpriteBatch> mBatches[Engine::IMAGE_MAX];
 
 		typedef std::vector<std::unique_ptr<SpriteBatch::Template>> TemplateSet;
 		std::array<TemplateSet, Engine::IMAGE_MAX> mTemplates;
 
-		std::shared_ptr<SpriteBatch::Instance> mBackground[GRID_DIM * GRID_DIM];
-		
-		std::shared_ptr<SpriteBatch::Instance> mDiamonds[GRID_DIM * GRID_DIM];
-		Engine::Diamond mDiamondsTemplateMap[GRID_DIM * GRID_DIM];
+		int32_t mGridColumns;
+		int32_t mGridRows;
+
+		// By grid index
+		std::vector<SpriteBatch::Handle> mBackground;
+		std::vector<SpriteBatch::Handle> mDiamonds;
 
-		std::shared_ptr<SpriteBatch::Instance> mTextChars[MAX_CHARS];
+		// Diamond of each cell, a byte plane, DIAMOND_MAX where empty
+		std::vector<uint8_t> mDiamondsTemplateMap;
+
+		std::vector<SpriteBatch::Handle> mTextChars;
 		size_t mNextCharInstance;
+		size_t mTextPagesHighWater;
+		size_t mTextPagesIdleFrames;
 
-		std::vector<std::shared_ptr<SpriteBatch::Instance>> mPendingDiamonds;
+		// Retained text, each one owns the glyph instances of its string
+		struct TextObject
+		{
+			std::string mText;
+			glm::vec2 mPosition;
+			glm::vec4 mColor;
+			float mSize;
+			float mWidth;
+			std::vector<SpriteBatch::Handle> mGlyphs;
+			bool mAlive;
+			bool mDirty;
+		};
 
-		float mElapsedTicks;
+		std::vector<TextObject> mTexts;
+		std::vector<int32_t> mFreeTexts;
+		bool mDirtyTexts;
+
+		// Direct mapped by string hash, a collision evicts the older run
+		std::array<GlyphRun, GLYPH_RUN_CACHE_SIZE> mGlyphRuns;
+
+		std::vector<SpriteBatch::Handle> mPendingDiamonds;
+
+		// Single producer, single consumer ring of frames. The indices only
+		// grow, the producer writes the frames from the read index onwards.
+		struct RenderFrame
+		{
+			std::array<SpriteBatch::FramePacket, Engine::IMAGE_MAX> mPackets;
+			uint64_t mInputNanoseconds;
+		};
+
+		std::array<RenderFrame, RenderQueueFrames> mRenderFrames;
+		std::atomic<uint32_t> mRenderWriteIndex;
+		std::atomic<uint32_t> mRenderReadIndex;
+		std::atomic<bool> mRenderQuit;
+		std::thread mRenderThread;
+
+		// Only waited on while the queue is full, or empty, the frames
+		// themselves go through the atomic indices.
+		std::mutex mRenderMutex;
+		std::condition_variable mRenderQueueChanged;
+
+		bool mRenderOnDemand;
+
+		// Loop modes, as chosen before Start()
+		bool mFixedTimestep;
+		bool mUseRenderThread;
+
+		// Simulation time is kept in whole nanoseconds, so that the
+		// same steps always add up to the same time.
+		uint64_t mFrameStartNanoseconds;
+		uint64_t mAccumulatedNanoseconds;
+		uint64_t mSimulationNanoseconds;
+		float mFrameInterpolation;
 		float mLastFrameSeconds;
+		uint32_t mLastFrameUploadedBytes;
 		Updater* mUpdater;
 		bool mQuit;
 
 		float mMouseX;
 		float mMouseY;
-		bool mMouseButtonDown;
 		uint8_t mMouseButtonsMask;
+		uint8_t mMouseButtonsPressed;
 
 		bool mKeyDown[256];
+		bool mKeyPressed[256];
+
+		// Ring of input events, the counts only grow. [mInputFirst, mInputWritten)
+		// is waiting for the next update, [mUpdateInputFirst, mUpdateInputEnd)
+		// is what the current one gets.
+		std::array<Engine::InputEvent, MaxInputEvents> mInputEvents;
+		uint64_t mInputWritten;
+		uint64_t mInputFirst;
+		uint64_t mUpdateInputFirst;
+		uint64_t mUpdateInputEnd;
+
+		// Oldest input responded to by the frame being built, 0 if none
+		uint64_t mFrameInputNanoseconds;
+		std::atomic<uint64_t> mInputLatencyNanoseconds;
 		
-		Implementation()
-			: mSdl(SDL_INIT_VIDEO | SDL_INIT_TIMER | SDL_INIT_NOPARACHUTE)
-			, mSdlWindow(WindowWidth, WindowHeight)
-			, mGlContext(mSdlWindow)
+		Implementation(Engine::Backend backend, int32_t grid_columns, int32_t grid_rows)
+			: mSdl((backend == Engine::BACKEND_NULL ? SDL_INIT_EVENTS : SDL_INIT_VIDEO)
+				| SDL_INIT_TIMER | SDL_INIT_NOPARACHUTE)
+			, mBackend(backend)
+			, mOffscreenFramebuffer(0)
+			, mGridColumns(grid_columns)
+			, mGridRows(grid_rows)
+			, mNextCharInstance(0)
+			, mTextPagesHighWater(0)
+			, mTextPagesIdleFrames(0)
+			, mDirtyTexts(false)
+			, mRenderWriteIndex(0)
+			, mRenderReadIndex(0)
+			, mRenderQuit(false)
+			, mRenderOnDemand(false)
+			, mFixedTimestep(false)
+			, mUseRenderThread(false)
+			, mFrameStartNanoseconds(ClockNanoseconds())
+			, mAccumulatedNanoseconds(0)
+			, mSimulationNanoseconds(0)
+			, mFrameInterpolation(1.0f)
 			, mLastFrameSeconds(1.0f / 60.0f)
+			, mLastFrameUploadedBytes(0)
+			, mUpdater(nullptr)
+			, mQuit(false)
 			, mMouseX(WindowWidth * 0.5f)
 			, mMouseY(WindowHeight * 0.5f)
-			, mMouseButtonDown(false)
 			, mMouseButtonsMask(0x0)
-			, mQuit(false)
-			, mUpdater(nullptr)
-			, mElapsedTicks(static_cast<float>(SDL_GetTicks()))
+			, mMouseButtonsPressed(0x0)
+			, mInputWritten(0)
+			, mInputFirst(0)
+			, mUpdateInputFirst(0)
+			, mUpdateInputEnd(0)
+			, mFrameInputNanoseconds(0)
+			, mInputLatencyNanoseconds(0)
 		{
 			memset(mKeyDown, 0, sizeof(mKeyDown));
+			memset(mKeyPressed, 0, sizeof(mKeyPressed));
+			memset(mOffscreenRenderbuffers, 0, sizeof(mOffscreenRenderbuffers));
+
+			if (mBackend == Engine::BACKEND_NULL) {
+				return;
+			}
+
+			// The window framebuffer is never drawn to offscreen, hence it
+			// doesn't need samples, which software contexts may not offer.
+			if (mBackend == Engine::BACKEND_OFFSCREEN) {
+				SDL_GL_SetAttribute(SDL_GL_MULTISAMPLEBUFFERS, 0);
+				SDL_GL_SetAttribute(SDL_GL_MULTISAMPLESAMPLES, 0);
+			}
+
+			mSdlWindow.reset(new SdlWindow(WindowWidth, WindowHeight));
+			mGlContext.reset(new GlContext(*mSdlWindow));
+
+			if (mBackend == Engine::BACKEND_OFFSCREEN) {
+				InitOffscreenTarget();
+			}
 		}
 
 		~Implementation()
 		{
 			mUpdater = nullptr;
+
+			// Left running by an exception, the context is needed back
+			if (mRenderThread.joinable()) {
+				StopRenderThread();
+			}
+
+			if (mGlContext) {
+				PROFILE_RELEASE_GPU();
+			}
+
+			if (mOffscreenFramebuffer) {
+				glDeleteFramebuffers(1, &mOffscreenFramebuffer);
+				glDeleteRenderbuffers(2, mOffscreenRenderbuffers);
+			}
 		}
 
-		int32_t GetGridDims() const;
 		int32_t GetGridStartX() const;
 		int32_t GetGridStartY() const;
-		int32_t GetGridWidth() const;
-		int32_t GetGridHeight() const;
+		int32_t GetGridArea() const;
 
 		float GetCellSize() const;
 		int32_t GetNumOfGridCells() const;
 
-		std::unique_ptr<SpriteBatch>& GetBackgroundBatch();
-		std::unique_ptr<SpriteBatch>& GetDiamondBatch();
-		std::unique_ptr<SpriteBatch>& GetTextBatch();
+		std::shared_ptr<SpriteBatch>& GetBackgroundBatch();
+		std::shared_ptr<SpriteBatch>& GetDiamondBatch();
+		std::shared_ptr<SpriteBatch>& GetTextBatch();
 
 		TemplateSet& GetBackgroundTemplates();
 		TemplateSet& GetDiamondTemplates();
 		TemplateSet& GetTextTemplates();
 
 		void Start();
-		void ParseEvents();
+		void PresentFrame(uint64_t input_nanoseconds);
+		void ClearFrame();
+		void DrawBatches();
+		bool IsMergedBatch(size_t image) const;
+
+		void StartRenderThread();
+		void StopRenderThread();
+		void NotifyRenderQueue();
+		void BuildRenderFrame();
+		void RenderLoop();
 
+		void ParseEvents();
+		bool NeedsRedraw() const;
+		void WaitForChange();
+		void PushInputEvent(Engine::InputType type, int32_t code, uint32_t sdl_timestamp, uint64_t poll_nanoseconds);
+		void AdvanceTime(uint64_t frame_nanoseconds);
+		void StepSimulation(uint64_t step_nanoseconds);
+		void SetBatchesTime(uint64_t nanoseconds);
+
+		void InitOffscreenTarget();
 		void InitSpriteBatches(const std::string & assets_dir);
+		void InitNullBatches(const std::string* texture_files, glm::vec4 viewport);
 		void InitSpriteTemplates();
+		const SpriteBatch::Template& CreateSpriteTemplate(Engine::Image image, glm::vec4 atlas_offsets);
 		void InitSpriteIntances();
+
+		size_t ReserveTextChars(size_t count);
+		void TrimTextPages();
+
+		bool IsValidText(int32_t text_id) const;
+		void InvalidateText(int32_t text_id);
+		const GlyphRun& GetGlyphRun(const char* text);
+		void LayoutGlyphs(const GlyphRun& run, const SpriteBatch::Handle* glyphs, size_t count, glm::vec2 position, glm::vec4 color, float size, float rotation);
+		void LayoutTexts();
 	};
 
 	//////////////////////////////////////////////////////////////////////////
 	// ENGINE
 	//////////////////////////////////////////////////////////////////////////
 
-	Engine::Engine(const char* assets_directory)
-		: mPimpl(new Implementation) {
+	Engine::Engine(const char* assets_directory, Backend backend, int32_t grid_width, int32_t grid_height) {
+
+		if (grid_width < 1 || grid_width > MaxGridDim || grid_height < 1 || grid_height > MaxGridDim) {
+			throw std::runtime_error(std::string("Invalid grid of ") + std::to_string(grid_width)
+				+ "x" + std::to_string(grid_height) + ", sides go from 1 to " + std::to_string(MaxGridDim));
+		}
+
+		mPimpl.reset(new Implementation(backend, grid_width, grid_height));
 
-		// VSync enabled
-		SDL_GL_SetSwapInterval(1);
+		if (backend != BACKEND_NULL)
+		{
+			// VSync enabled, frames rendered offscreen go as fast as they can
+			SDL_GL_SetSwapInterval(backend == BACKEND_WINDOW ? 1 : 0);
 
-		glEnable(GL_BLEND);
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+			glEnable(GL_BLEND);
+			glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		}
 
 		std::string assets_dir(assets_directory);
 		mPimpl->InitSpriteBatches(assets_dir);
@@ -141,6 +422,14 @@ namespace King {
 		return mPimpl->mLastFrameSeconds;
 	}
 
+	float Engine::GetFrameInterpolation() const {
+		return mPimpl->mFrameInterpolation;
+	}
+
+	uint32_t Engine::GetLastFrameUploadedBytes() const {
+		return mPimpl->mLastFrameUploadedBytes;
+	}
+
 	float Engine::GetMouseX() const {
 		return mPimpl->mMouseX;
 	}
@@ -151,88 +440,175 @@ namespace King {
 
 	bool Engine::IsMouseButtonDown(uint8_t index) const {
 		
-		return (
-			mPimpl->mMouseButtonDown &&
-			mPimpl->mMouseButtonsMask & (1 << index));
+		return ((mPimpl->mMouseButtonsMask | mPimpl->mMouseButtonsPressed) & (1 << index)) != 0;
 	}
 
 	bool Engine::IsKeyDown(uint8_t key) const
 	{
-		return mPimpl->mKeyDown[key];
+		return mPimpl->mKeyDown[key] || mPimpl->mKeyPressed[key];
+	}
+
+	size_t Engine::GetInputEventCount() const {
+		return size_t(mPimpl->mUpdateInputEnd - mPimpl->mUpdateInputFirst);
+	}
+
+	const Engine::InputEvent& Engine::GetInputEvent(size_t index) const {
+		assert(index < GetInputEventCount());
+		return mPimpl->mInputEvents[(mPimpl->mUpdateInputFirst + index) % MaxInputEvents];
+	}
+
+	float Engine::GetInputLatencySeconds() const {
+		return NanosecondsToSeconds(mPimpl->mInputLatencyNanoseconds.load(std::memory_order_relaxed));
 	}
 	
 	void Engine::Quit() {
 		mPimpl->mQuit = true;
 	}
 
+	void Engine::SetRenderOnDemand(bool enabled) {
+		mPimpl->mRenderOnDemand = enabled;
+	}
+
+	void Engine::SetFixedTimestep(bool enabled) {
+		mPimpl->mFixedTimestep = enabled;
+	}
+
+	void Engine::SetRenderThread(bool enabled) {
+		mPimpl->mUseRenderThread = enabled;
+	}
+
 	void Engine::Start(Updater& updater) {
 		mPimpl->mUpdater = &updater;
-		mPimpl->mSdlWindow.Show();
+		if (mPimpl->mBackend == BACKEND_WINDOW) {
+			mPimpl->mSdlWindow->Show();
+		}
+
 		mPimpl->Start();
 	}
 
-	Glyph& FindGlyph(char c) {
-		auto found = std::lower_bound(std::begin(Font), std::end(Font), c);
-		if (found == std::end(Font) || c < *found) {
-			found = std::lower_bound(std::begin(Font), std::end(Font), static_cast<int>('_'));
-		}
-		return *found;
+	// From the cached run, as wide as Write() lays the text out
+	float Engine::CalculateStringWidth(const char* text, float size) const {
+		return mPimpl->GetGlyphRun(text).mWidth * size;
+	}
+
+	float Engine::Write(const char* text, glm::vec2 position, glm::vec4 color, float size, float rotation) {
+
+		const GlyphRun& run = mPimpl->GetGlyphRun(text);
+
+		// Truncated only if the text batch can't grow any further
+		const size_t n_chars = mPimpl->ReserveTextChars(run.mGlyphs.size());
+		mPimpl->LayoutGlyphs(run, &mPimpl->mTextChars[mPimpl->mNextCharInstance], n_chars,
+			position, color, size, rotation);
+		mPimpl->mNextCharInstance += n_chars;
+
+		return n_chars < run.mGlyphs.size() ? 0.f : run.mWidth * size;
 	}
 
-	float Engine::CalculateStringWidth(const char* text) const {
-		int advance = 0;
-		for (; *text; ++text) {
-			Glyph& g = FindGlyph(*text);
-			advance += g.advance;
+	int32_t Engine::CreateText(const char* text, glm::vec2 position, glm::vec4 color, float size) {
+
+		int32_t text_id = int32_t(mPimpl->mTexts.size());
+		if (!mPimpl->mFreeTexts.empty()) {
+			text_id = mPimpl->mFreeTexts.back();
+			mPimpl->mFreeTexts.pop_back();
+		}
+		else {
+			mPimpl->mTexts.emplace_back();
 		}
-		return advance*TextScale;
+
+		auto& text_object = mPimpl->mTexts[text_id];
+		text_object.mText.clear();
+		text_object.mPosition = position;
+		text_object.mColor = color;
+		text_object.mSize = size;
+		text_object.mWidth = 0.f;
+		text_object.mAlive = true;
+
+		mPimpl->InvalidateText(text_id);
+		SetText(text_id, text);
+		return text_id;
 	}
 
-	float Engine::Write(const char* text, glm::vec2 position, glm::vec4 color, float size, float rotation) {
+	void Engine::SetText(int32_t text_id, const char* text) {
+		assert(mPimpl->IsValidText(text_id));
+		auto& text_object = mPimpl->mTexts[text_id];
+		if (text_object.mText == text) {
+			return;
+		}
 
-		auto& text_batch = mPimpl->GetTextBatch();
-		
-		float advance = 0.f;
-		for (; *text; ++text) {
+		text_object.mText = text;
+		text_object.mWidth = CalculateStringWidth(text, text_object.mSize);
 
-			// TODO: Reuse empty chars by returning a text handler
-			if (mPimpl->mNextCharInstance >= MAX_CHARS) {
-				return 0.f;
-			}
+		mPimpl->InvalidateText(text_id);
+	}
+
+	void Engine::SetTextPosition(int32_t text_id, glm::vec2 position) {
+		assert(mPimpl->IsValidText(text_id));
+		auto& text_object = mPimpl->mTexts[text_id];
+		if (text_object.mPosition != position) {
+			text_object.mPosition = position;
+			mPimpl->InvalidateText(text_id);
+		}
+	}
+
+	void Engine::SetTextColor(int32_t text_id, glm::vec4 color) {
+		assert(mPimpl->IsValidText(text_id));
+		auto& text_object = mPimpl->mTexts[text_id];
+		if (text_object.mColor != color) {
+			text_object.mColor = color;
+			mPimpl->InvalidateText(text_id);
+		}
+	}
 
-			auto& char_instance = mPimpl->mTextChars[mPimpl->mNextCharInstance++];
-			text_batch->swapInstanceTemplate(char_instance, *mPimpl->GetTextTemplates()[*text]);
+	void Engine::SetTextSize(int32_t text_id, float size) {
+		assert(mPimpl->IsValidText(text_id));
+		auto& text_object = mPimpl->mTexts[text_id];
+		if (text_object.mSize != size) {
+			text_object.mSize = size;
+			text_object.mWidth = CalculateStringWidth(text_object.mText.c_str(), size);
+			mPimpl->InvalidateText(text_id);
+		}
+	}
 
-			Glyph& g = FindGlyph(*text);
+	float Engine::GetTextWidth(int32_t text_id) const {
+		assert(mPimpl->IsValidText(text_id));
+		return mPimpl->mTexts[text_id].mWidth;
+	}
 
-			float scale = size / float(g.height + g.yoffset);
-			glm::vec2 char_size = glm::vec2(g.width + g.xoffset, g.height) * scale;
+	void Engine::DestroyText(int32_t text_id) {
+		assert(mPimpl->IsValidText(text_id));
+		auto& text_object = mPimpl->mTexts[text_id];
+		auto& text_batch = mPimpl->GetTextBatch();
 
-			text_batch->updateInstance(char_instance, glm::vec2(position.x + advance, position.y), char_size, color, rotation);
-			advance += g.advance * CharSpacing * scale;
+		for (auto glyph : text_object.mGlyphs) {
+			text_batch->removeInstance(glyph);
 		}
 
-		return advance;
+		text_object.mGlyphs.clear();
+		text_object.mText.clear();
+		text_object.mAlive = false;
+		text_object.mDirty = false;
+		mPimpl->mFreeTexts.push_back(text_id);
 	}
 
 	void Engine::Erease()
 	{
 		auto& text_batch = mPimpl->GetTextBatch();
-		for (auto c = 0; c < MAX_CHARS; ++c) {
+		for (size_t c = 0; c < mPimpl->mNextCharInstance; ++c) {
 
-			// Make sure we don't display dead chars
-			auto& char_instance = mPimpl->mTextChars[c];
+			// Make sure we don't display dead chars, the others are collapsed already
+			auto char_instance = mPimpl->mTextChars[c];
 			text_batch->swapInstanceTemplate(char_instance, *mPimpl->GetTextTemplates()[0]);
 			text_batch->updateInstance(char_instance, glm::vec2(0.f), glm::vec2(0.f));
 		}
 
+		mPimpl->TrimTextPages();
 		mPimpl->mNextCharInstance = 0;
 	}
 
 	void Engine::ChangeCell(int32_t index, Background new_template)
 	{
 		assert(IsValidGridIndex(index));
-		auto& instance = mPimpl->mBackground[index];
+		auto instance = mPimpl->mBackground[index];
 		auto& grid_batch = mPimpl->GetBackgroundBatch();
 		const auto& sprite_template = mPimpl->GetBackgroundTemplates()[new_template];
 		grid_batch->swapInstanceTemplate(instance, *sprite_template);
@@ -241,7 +617,7 @@ namespace King {
 	void Engine::UpdateCell(int32_t index, glm::vec2 size, glm::vec4 color, float rotation)
 	{
 		assert(IsValidGridIndex(index));
-		auto& instance = mPimpl->mBackground[index];
+		auto instance = mPimpl->mBackground[index];
 		auto& grid_batch = mPimpl->GetBackgroundBatch();
 		grid_batch->updateInstance(instance, grid_batch->getInstancePosition(instance), size, color, rotation);
 	}
@@ -250,7 +626,7 @@ namespace King {
 	{
 		assert(IsValidGridIndex(index));
 		auto& diamonds_batch = mPimpl->GetDiamondBatch();
-		auto& instance = mPimpl->mDiamonds[index];
+		auto instance = mPimpl->mDiamonds[index];
 
 		// Moving is relative to current instance state.
 		position = diamonds_batch->getInstancePosition(instance);
@@ -262,7 +638,7 @@ namespace King {
 	void Engine::UpdateDiamond(int32_t index, glm::vec2 position, glm::vec2 size, glm::vec4 color, float rotation)
 	{
 		assert(IsValidGridIndex(index));
-		auto& instance = mPimpl->mDiamonds[index];
+		auto instance = mPimpl->mDiamonds[index];
 		auto& diamonds_batch = mPimpl->GetDiamondBatch();
 		diamonds_batch->updateInstance(instance, position, size, color, rotation);
 	}
@@ -271,7 +647,7 @@ namespace King {
 	{
 		assert(IsValidGridIndex(index));
 		auto& diamonds_batch = mPimpl->GetDiamondBatch();
-		auto& instance = mPimpl->mDiamonds[index];
+		auto instance = mPimpl->mDiamonds[index];
 
 		// Moving is relative to current instance state.
 		glm::vec2 position = diamonds_batch->getInstancePosition(instance) + translate;
@@ -282,14 +658,37 @@ namespace King {
 		diamonds_batch->updateInstance(instance, position, size, color, rotation);
 	}
 
+	void Engine::TweenDiamond(int32_t index, glm::vec2 position, glm::vec2 size, glm::vec4 color, float rotation, float duration, Easing easing)
+	{
+		assert(IsValidGridIndex(index));
+		auto instance = mPimpl->mDiamonds[index];
+		auto& diamonds_batch = mPimpl->GetDiamondBatch();
+
+		// Evaluated on the GPU from now on, no per frame update required
+		diamonds_batch->setInstanceDepth(instance, MovingDiamondDepth);
+		diamonds_batch->tweenInstance(instance, position, size, color, rotation,
+			diamonds_batch->getTime(), duration, static_cast<SpriteBatch::Easing>(easing));
+	}
+
+	void Engine::SettleDiamond(int32_t index)
+	{
+		assert(IsValidGridIndex(index));
+		if (IsCellFull(index)) {
+			mPimpl->GetDiamondBatch()->setInstanceDepth(mPimpl->mDiamonds[index], RestingDiamondDepth);
+		}
+	}
+
 	void Engine::ChangeDiamond(int32_t index, Diamond new_template)
 	{
 		assert(IsValidGridIndex(index));
-		auto& instance = mPimpl->mDiamonds[index];
+		auto instance = mPimpl->mDiamonds[index];
 		auto& diamonds_batch = mPimpl->GetDiamondBatch();
 		const auto& sprite_template = mPimpl->GetDiamondTemplates()[new_template];
 		diamonds_batch->swapInstanceTemplate(instance, *sprite_template);
-		mPimpl->mDiamondsTemplateMap[index] = new_template;
+
+		if (IsCellFull(index)) {
+			mPimpl->mDiamondsTemplateMap[index] = uint8_t(new_template);
+		}
 	}
 
 	void Engine::AddDiamond(int32_t index, Diamond diamond_template)
@@ -303,7 +702,7 @@ namespace King {
 		auto& diamonds_batch = mPimpl->GetDiamondBatch();
 		mPimpl->mDiamonds[index] = diamonds_batch->addInstance(*mPimpl->GetDiamondTemplates()[diamond_template]);
 		diamonds_batch->updateInstance(instance, GetCellPosition(index), glm::vec2(mPimpl->GetCellSize()) * DiamondScale);
-		mPimpl->mDiamondsTemplateMap[index] = diamond_template;
+		mPimpl->mDiamondsTemplateMap[index] = uint8_t(diamond_template);
 	}
 
 	void Engine::RemoveDiamond(int32_t index)
@@ -312,10 +711,22 @@ namespace King {
 		{
 			auto& diamonds_batch = mPimpl->GetDiamondBatch();
 			diamonds_batch->removeInstance(mPimpl->mDiamonds[index]);
-			mPimpl->mDiamonds[index] = nullptr;
+			mPimpl->mDiamonds[index] = SpriteBatch::Handle::INVALID;
+			mPimpl->mDiamondsTemplateMap[index] = uint8_t(Engine::DIAMOND_MAX);
 		}
 	}
 
+	void Engine::RelocateDiamond(int32_t from_index, int32_t to_index)
+	{
+		assert(IsCellFull(from_index) && !IsCellFull(to_index));
+
+		mPimpl->mDiamonds[to_index] = mPimpl->mDiamonds[from_index];
+		mPimpl->mDiamondsTemplateMap[to_index] = mPimpl->mDiamondsTemplateMap[from_index];
+
+		mPimpl->mDiamonds[from_index] = SpriteBatch::Handle::INVALID;
+		mPimpl->mDiamondsTemplateMap[from_index] = uint8_t(Engine::DIAMOND_MAX);
+	}
+
 	void Engine::AddFloatingDiamond(float x, float y, Diamond diamond_template)
 	{
 		auto& diamonds_batch = mPimpl->GetDiamondBatch();
@@ -331,20 +742,17 @@ namespace King {
 	{
 		screen_y = GetWindowHeight() - screen_y;
 
-		const int32_t end_x = mPimpl->GetGridStartX() + mPimpl->GetGridWidth();
-		const int32_t end_y = mPimpl->GetGridStartY() + mPimpl->GetGridHeight();
-
-		if (screen_x >= mPimpl->GetGridStartX() && screen_x < end_x
-			&& screen_y >= mPimpl->GetGridStartY() && screen_y < end_y) {
+		const int32_t grid_x = screen_x - mPimpl->GetGridStartX();
+		const int32_t grid_y = screen_y - mPimpl->GetGridStartY();
 
-			int32_t grid_x = screen_x - mPimpl->GetGridStartX();
-			int32_t grid_y = screen_y - mPimpl->GetGridStartY();
+		// Cells can be smaller than a pixel
+		if (grid_x >= 0 && grid_y >= 0) {
 
-			int32_t cell_x = grid_x / int32_t(mPimpl->GetCellSize());
-			int32_t cell_y = grid_y / int32_t(mPimpl->GetCellSize());
+			const int32_t cell_x = int32_t(float(grid_x) / mPimpl->GetCellSize());
+			const int32_t cell_y = int32_t(float(grid_y) / mPimpl->GetCellSize());
 
-			if (cell_y < mPimpl->GetGridDims() && cell_x < mPimpl->GetGridDims()) {
-				return cell_y * mPimpl->GetGridDims() + cell_x;
+			if (cell_y < mPimpl->mGridRows && cell_x < mPimpl->mGridColumns) {
+				return cell_y * mPimpl->mGridColumns + cell_x;
 			}
 		}
 
@@ -354,8 +762,8 @@ namespace King {
 	glm::vec2 Engine::GetCellPosition(int32_t index) const
 	{
 		assert(IsValidGridIndex(index));
-		int32_t row_id = index / mPimpl->GetGridDims();
-		int32_t col_id = index - (row_id * mPimpl->GetGridDims());
+		int32_t row_id = index / mPimpl->mGridColumns;
+		int32_t col_id = index - (row_id * mPimpl->mGridColumns);
 
 		return glm::vec2(
 			col_id * mPimpl->GetCellSize() + mPimpl->GetGridStartX(),
@@ -365,7 +773,7 @@ namespace King {
 	bool Engine::IsCellFull(int32_t index) const
 	{
 		assert(IsValidGridIndex(index));
-		return mPimpl->mDiamonds[index].get() != nullptr;
+		return mPimpl->mDiamonds[index].isValid();
 	}
 
 	bool Engine::IsValidGridIndex(int32_t index) const
@@ -375,19 +783,19 @@ namespace King {
 
 	int32_t Engine::GetGridIndex(int32_t grid_x, int32_t gird_y) const
 	{
-		return gird_y * mPimpl->GetGridDims() + grid_x;
+		return gird_y * mPimpl->mGridColumns + grid_x;
 	}
 
 	int32_t Engine::GetGriRow(int32_t index) const
 	{
 		assert(IsValidGridIndex(index));
-		return index / mPimpl->GetGridDims();
+		return index / mPimpl->mGridColumns;
 	}
 
 	int32_t Engine::GetGridColumn(int32_t index) const
 	{
 		assert(IsValidGridIndex(index));
-		return index - (GetGriRow(index) * mPimpl->GetGridDims());
+		return index - (GetGriRow(index) * mPimpl->mGridColumns);
 	}
 
 	int32_t Engine::GetGridSize() const
@@ -403,19 +811,22 @@ namespace King {
 	Engine::Diamond Engine::GetGridDiamond(int32_t index) const
 	{
 		assert(IsValidGridIndex(index));
-		return IsCellFull(index)
-			? mPimpl->mDiamondsTemplateMap[index]
-			: Diamond::DIAMOND_MAX;
+		return static_cast<Diamond>(mPimpl->mDiamondsTemplateMap[index]);
+	}
+
+	const uint8_t* Engine::GetDiamondPlane() const
+	{
+		return mPimpl->mDiamondsTemplateMap.data();
 	}
 
 	int32_t Engine::GetGridWidth() const
 	{
-		return mPimpl->GetGridDims();
+		return mPimpl->mGridColumns;
 	}
 
 	int32_t Engine::GetGridHeight() const
 	{
-		return mPimpl->GetGridDims();
+		return mPimpl->mGridRows;
 	}
 
 	int32_t Engine::GetWindowWidth() const {
@@ -430,10 +841,6 @@ namespace King {
 	// ENGINE IMPLEMENTATION
 	//////////////////////////////////////////////////////////////////////////
 
-	int32_t Engine::Implementation::GetGridDims() const {
-		return GRID_DIM;
-	}
-
 	int32_t Engine::Implementation::GetGridStartX() const {
 		return 10;
 	}
@@ -442,33 +849,34 @@ namespace King {
 		return 40;
 	}
 
-	int32_t Engine::Implementation::GetGridWidth() const {
-		return GetGridHeight();
-	}
-
-	int32_t Engine::Implementation::GetGridHeight() const {
+	// Side of the square the board fits in
+	int32_t Engine::Implementation::GetGridArea() const {
 		return WindowHeight - GetGridStartY();
 	}
 
+	// Whole pixels, unless the cells are smaller than that
 	float Engine::Implementation::GetCellSize() const {
-		return float(GetGridHeight() / GetGridDims());
+		const int32_t cells = std::max(mGridColumns, mGridRows);
+		return GetGridArea() >= cells
+			? float(GetGridArea() / cells)
+			: float(GetGridArea()) / float(cells);
 	}
 
 	int32_t Engine::Implementation::GetNumOfGridCells() const {
-		return GetGridDims() * GetGridDims();
+		return mGridColumns * mGridRows;
 	}
 
-	std::unique_ptr<SpriteBatch>& Engine::Implementation::GetBackgroundBatch()
+	std::shared_ptr<SpriteBatch>& Engine::Implementation::GetBackgroundBatch()
 	{
 		return mBatches[Engine::IMAGE_BACKGROUND];
 	}
 
-	std::unique_ptr<SpriteBatch>& Engine::Implementation::GetDiamondBatch()
+	std::shared_ptr<SpriteBatch>& Engine::Implementation::GetDiamondBatch()
 	{
 		return mBatches[Engine::IMAGE_DIAMONDS];
 	}
 
-	std::unique_ptr<SpriteBatch>& Engine::Implementation::GetTextBatch()
+	std::shared_ptr<SpriteBatch>& Engine::Implementation::GetTextBatch()
 	{
 		return mBatches[Engine::IMAGE_TEXT];
 	}
@@ -485,16 +893,211 @@ namespace King {
 		return mTemplates[Engine::IMAGE_TEXT];
 	}
 
+	size_t Engine::Implementation::ReserveTextChars(size_t count) {
+		auto& text_batch = GetTextBatch();
+
+		// New pages start collapsed, with the null character '\0'
+		while (mTextChars.size() < mNextCharInstance + count) {
+			for (size_t c = 0; c < GLYPH_PAGE_SIZE; ++c) {
+				auto char_instance = text_batch->addInstance(*GetTextTemplates()[0]);
+				if (!char_instance.isValid()) {
+					return mTextChars.size() - mNextCharInstance;
+				}
+
+				mTextChars.push_back(char_instance);
+			}
+		}
+
+		return count;
+	}
+
+	void Engine::Implementation::TrimTextPages() {
+		const size_t used_pages = (mNextCharInstance + GLYPH_PAGE_SIZE - 1) / GLYPH_PAGE_SIZE;
+		mTextPagesHighWater = std::max(mTextPagesHighWater, used_pages);
+
+		if (++mTextPagesIdleFrames < GLYPH_PAGE_IDLE_FRAMES) {
+			return;
+		}
+
+		// Release whatever has not been written lately
+		auto& text_batch = GetTextBatch();
+		const size_t keep_chars = mTextPagesHighWater * GLYPH_PAGE_SIZE;
+		while (mTextChars.size() > keep_chars) {
+			text_batch->removeInstance(mTextChars.back());
+			mTextChars.pop_back();
+		}
+
+		mTextPagesHighWater = 0;
+		mTextPagesIdleFrames = 0;
+	}
+
+	bool Engine::Implementation::IsValidText(int32_t text_id) const {
+		return text_id >= 0 && text_id < int32_t(mTexts.size()) && mTexts[text_id].mAlive;
+	}
+
+	void Engine::Implementation::InvalidateText(int32_t text_id) {
+		mTexts[text_id].mDirty = true;
+		mDirtyTexts = true;
+	}
+
+	const GlyphRun& Engine::Implementation::GetGlyphRun(const char* text) {
+		const size_t length = strlen(text);
+		const size_t hash = HashString(text, length);
+
+		GlyphRun& run = mGlyphRuns[hash % GLYPH_RUN_CACHE_SIZE];
+		if (run.mHash == hash && run.mText.compare(0, std::string::npos, text, length) == 0) {
+			return run;
+		}
+
+		// Each glyph is scaled so that its full height matches the size
+		run.mHash = hash;
+		run.mText.assign(text, length);
+		run.mGlyphs.clear();
+		run.mWidth = 0.f;
+
+		for (const char c : run.mText) {
+			const Glyph& g = FindGlyph(c);
+			const float scale = 1.f / float(g.height + g.yoffset);
+			run.mGlyphs.push_back({ run.mWidth, glm::vec2(g.width + g.xoffset, g.height) * scale });
+			run.mWidth += g.advance * CharSpacing * scale;
+		}
+
+		return run;
+	}
+
+	void Engine::Implementation::LayoutGlyphs(const GlyphRun& run, const SpriteBatch::Handle* glyphs, size_t count, glm::vec2 position, glm::vec4 color, float size, float rotation) {
+		auto& text_batch = GetTextBatch();
+		auto& text_templates = GetTextTemplates();
+
+		assert(count <= run.mGlyphs.size());
+		for (size_t c = 0; c < count; ++c) {
+			const GlyphRun::Placement& placement = run.mGlyphs[c];
+			text_batch->swapInstanceTemplate(glyphs[c], *text_templates[uint8_t(run.mText[c])]);
+			text_batch->updateInstance(glyphs[c], glm::vec2(position.x + placement.mOffset * size, position.y),
+				placement.mSize * size, color, rotation);
+		}
+	}
+
+	void Engine::Implementation::LayoutTexts() {
+		if (!mDirtyTexts) {
+			return;
+		}
+
+		PROFILE_SCOPE("Engine::LayoutTexts");
+
+		auto& text_batch = GetTextBatch();
+		for (auto& text_object : mTexts)
+		{
+			if (!text_object.mDirty) {
+				continue;
+			}
+
+			// Glyph instances follow the length of the string
+			const size_t n_chars = text_object.mText.length();
+			while (text_object.mGlyphs.size() > n_chars) {
+				text_batch->removeInstance(text_object.mGlyphs.back());
+				text_object.mGlyphs.pop_back();
+			}
+
+			while (text_object.mGlyphs.size() < n_chars) {
+				text_object.mGlyphs.push_back(text_batch->addInstance(*GetTextTemplates()[0]));
+			}
+
+			LayoutGlyphs(GetGlyphRun(text_object.mText.c_str()), text_object.mGlyphs.data(), n_chars,
+				text_object.mPosition, text_object.mColor, text_object.mSize, 0.f);
+
+			text_object.mDirty = false;
+		}
+
+		mDirtyTexts = false;
+	}
+
 	void Engine::Implementation::Start() {
-		
+
+		PROFILE_THREAD("Main");
+
 		if (!mUpdater->Init()) {
 			return;
 		}
 
+		// Nothing to draw with the null backend
+		const bool threaded = mUseRenderThread && mBackend != Engine::BACKEND_NULL;
+		if (threaded) {
+			StartRenderThread();
+		}
+
+		// Loading doesn't count as a frame
+		mFrameStartNanoseconds = ClockNanoseconds();
+
+		bool frame_drawn = false;
+		bool frame_pending = false;
 		while (!mQuit)
 		{
-			SDL_GL_SwapWindow(mSdlWindow);
+			PROFILE_SCOPE("Engine::Frame");
+
+			// The frame built last time round goes out
+			if (frame_pending) {
+				PresentFrame(mFrameInputNanoseconds);
+				mFrameInputNanoseconds = 0;
+				frame_pending = false;
+			}
+
+			const uint64_t frame_start = ClockNanoseconds();
+			const uint64_t frame_nanoseconds = std::min(frame_start - mFrameStartNanoseconds, MaxFrameNanoseconds);
+			mFrameStartNanoseconds = frame_start;
+
+			// Give a chance to update
+			AdvanceTime(frame_nanoseconds);
+
+			// Changed text only
+			LayoutTexts();
+
+			// Nothing would look any different, the last frame stays up
+			if (mRenderOnDemand && frame_drawn && !NeedsRedraw()) {
+				mLastFrameUploadedBytes = 0;
+				WaitForChange();
+				continue;
+			}
+
+			if (threaded) {
+				BuildRenderFrame();
+			}
+			else {
+				ClearFrame();
+				DrawBatches();
+				PROFILE_COLLECT_GPU();
+				frame_pending = true;
+			}
+
+			frame_drawn = true;
+		}
+
+		if (threaded) {
+			StopRenderThread();
+		}
+	}
+
+	void Engine::Implementation::PresentFrame(uint64_t input_nanoseconds) {
+
+		PROFILE_SCOPE("Engine::PresentFrame");
+
+		// Offscreen frames are only flushed, the framebuffer stays bound
+		if (mBackend == Engine::BACKEND_WINDOW) {
+			SDL_GL_SwapWindow(*mSdlWindow);
+		}
+		else if (mBackend == Engine::BACKEND_OFFSCREEN) {
+			glFlush();
+		}
+
+		if (input_nanoseconds) {
+			mInputLatencyNanoseconds.store(ClockNanoseconds() - input_nanoseconds, std::memory_order_relaxed);
+		}
+	}
+
+	void Engine::Implementation::ClearFrame() {
 
+		if (mBackend != Engine::BACKEND_NULL)
+		{
 			static float depth_value = 1.0f;
 			static glm::vec4 view_color(.96f, .95f, .8f, 1.f);
 			glClearBufferfv(GL_DEPTH, 0, &depth_value);
@@ -502,29 +1105,270 @@ namespace King {
 
 			glm::vec4 viewport = glm::vec4(0.0f, 0.0f, WindowWidth, WindowHeight);
 			glViewportIndexedfv(0, &viewport[0]);
+		}
+	}
 
-			ParseEvents();
-			
-			float currentTicks = static_cast<float>(SDL_GetTicks());
-			float lastFrameTicks = currentTicks - mElapsedTicks;
-			mElapsedTicks = currentTicks;
+	bool Engine::Implementation::IsMergedBatch(size_t image) const {
+		// Merged batches are flushed, and drawn, once
+		return image > 0 && mBatches[image] == mBatches[image - 1];
+	}
 
-			lastFrameTicks = std::min(lastFrameTicks, MaxFrameTicks);
-			mLastFrameSeconds = lastFrameTicks * 0.001f;
+	void Engine::Implementation::DrawBatches() {
 
-			// Give a chance to update
-			if (mUpdater) {
-				mUpdater->Update();
+		// Render all the batches
+		mLastFrameUploadedBytes = 0;
+		for (size_t i = 0; i < Engine::IMAGE_MAX; ++i)
+		{
+			if (IsMergedBatch(i)) {
+				continue;
 			}
 
-			// Render all the batches
-			for (auto i = 0; i < Engine::IMAGE_MAX; ++i)
+			auto& sprite_batch = mBatches[i];
+			sprite_batch->flushBuffers();
+			sprite_batch->draw();
+
+			mLastFrameUploadedBytes += uint32_t(sprite_batch->getUploadedBytes());
+		}
+	}
+
+	void Engine::Implementation::StartRenderThread() {
+
+		for (size_t i = 0; i < Engine::IMAGE_MAX; ++i) {
+			if (!IsMergedBatch(i)) {
+				mBatches[i]->setThreaded(true);
+			}
+		}
+
+		// A context is current on one thread at most
+		SDL_GL_MakeCurrent(*mSdlWindow, nullptr);
+
+		mRenderQuit.store(false);
+		mRenderThread = std::thread(&Implementation::RenderLoop, this);
+	}
+
+	void Engine::Implementation::StopRenderThread() {
+
+		// The queued frames are drawn before the thread exits
+		mRenderQuit.store(true, std::memory_order_release);
+		NotifyRenderQueue();
+		mRenderThread.join();
+
+		SDL_GL_MakeCurrent(*mSdlWindow, *mGlContext);
+
+		for (size_t i = 0; i < Engine::IMAGE_MAX; ++i) {
+			if (!IsMergedBatch(i)) {
+				mBatches[i]->setThreaded(false);
+			}
+		}
+	}
+
+	void Engine::Implementation::BuildRenderFrame() {
+
+		PROFILE_SCOPE("Engine::BuildRenderFrame");
+
+		// Wait for the render thread to be done with the oldest frame
+		const uint32_t write_index = mRenderWriteIndex.load(std::memory_order_relaxed);
+		{
+			PROFILE_SCOPE("Engine::WaitRenderFrame");
+			std::unique_lock<std::mutex> lock(mRenderMutex);
+			mRenderQueueChanged.wait(lock, [&]() {
+				return write_index - mRenderReadIndex.load(std::memory_order_acquire) < RenderQueueFrames;
+			});
+		}
+
+		RenderFrame& frame = mRenderFrames[write_index % RenderQueueFrames];
+
+		mLastFrameUploadedBytes = 0;
+		for (size_t i = 0; i < Engine::IMAGE_MAX; ++i)
+		{
+			if (IsMergedBatch(i)) {
+				continue;
+			}
+
+			auto& sprite_batch = mBatches[i];
+			sprite_batch->buildFramePacket(frame.mPackets[i]);
+
+			mLastFrameUploadedBytes += uint32_t(sprite_batch->getUploadedBytes());
+		}
+
+		frame.mInputNanoseconds = mFrameInputNanoseconds;
+		mFrameInputNanoseconds = 0;
+
+		mRenderWriteIndex.store(write_index + 1, std::memory_order_release);
+		NotifyRenderQueue();
+	}
+
+	void Engine::Implementation::NotifyRenderQueue() {
+
+		// Taking the lock orders the index change with the other side
+		// checking it, so a wake up can't be missed in between.
+		{
+			std::lock_guard<std::mutex> lock(mRenderMutex);
+		}
+
+		mRenderQueueChanged.notify_all();
+	}
+
+	void Engine::Implementation::RenderLoop() {
+
+		PROFILE_THREAD("Render");
+		SDL_GL_MakeCurrent(*mSdlWindow, *mGlContext);
+
+		for (;;)
+		{
+			const uint32_t read_index = mRenderReadIndex.load(std::memory_order_relaxed);
+			{
+				std::unique_lock<std::mutex> lock(mRenderMutex);
+				mRenderQueueChanged.wait(lock, [&]() {
+					return read_index != mRenderWriteIndex.load(std::memory_order_acquire)
+						|| mRenderQuit.load(std::memory_order_acquire);
+				});
+			}
+
+			// Only once all the frames built have been drawn
+			if (read_index == mRenderWriteIndex.load(std::memory_order_acquire)) {
+				break;
+			}
+
+			const RenderFrame& frame = mRenderFrames[read_index % RenderQueueFrames];
 			{
-				//if (0 == i) continue;
-				auto& sprite_batch = mBatches[i];
-				sprite_batch->flushBuffers();
-				sprite_batch->draw();
+				PROFILE_SCOPE("Engine::RenderFrame");
+
+				ClearFrame();
+				for (size_t i = 0; i < Engine::IMAGE_MAX; ++i) {
+					if (!IsMergedBatch(i)) {
+						mBatches[i]->submitFramePacket(frame.mPackets[i]);
+					}
+				}
+
+				PresentFrame(frame.mInputNanoseconds);
+				PROFILE_COLLECT_GPU();
+			}
+
+			mRenderReadIndex.store(read_index + 1, std::memory_order_release);
+			NotifyRenderQueue();
+		}
+
+		SDL_GL_MakeCurrent(*mSdlWindow, nullptr);
+	}
+
+	void Engine::Implementation::AdvanceTime(uint64_t frame_nanoseconds) {
+
+		if (!mFixedTimestep) {
+			StepSimulation(frame_nanoseconds);
+			mFrameInterpolation = 1.f;
+			return;
+		}
+
+		mAccumulatedNanoseconds += frame_nanoseconds;
+
+		uint32_t steps = 0;
+		while (mAccumulatedNanoseconds >= FixedStepNanoseconds && steps < MaxCatchUpSteps) {
+			StepSimulation(FixedStepNanoseconds);
+			mAccumulatedNanoseconds -= FixedStepNanoseconds;
+			++steps;
+		}
+
+		// Out of budget, whatever whole steps are left are not caught up with
+		mAccumulatedNanoseconds %= FixedStepNanoseconds;
+
+		// Tweens are functions of time, hence rendering them at a time
+		// in between the last two steps interpolates their two states.
+		const uint64_t previous_step = mSimulationNanoseconds - std::min(mSimulationNanoseconds, FixedStepNanoseconds);
+		mFrameInterpolation = float(double(mAccumulatedNanoseconds) / double(FixedStepNanoseconds));
+		SetBatchesTime(previous_step + mAccumulatedNanoseconds);
+	}
+
+	void Engine::Implementation::StepSimulation(uint64_t step_nanoseconds) {
+		mSimulationNanoseconds += step_nanoseconds;
+		mLastFrameSeconds = NanosecondsToSeconds(step_nanoseconds);
+
+		// Tweens started by the updater start at the simulation time
+		SetBatchesTime(mSimulationNanoseconds);
+
+		// Latched as late as possible, the update gets whatever came in since the last
+		ParseEvents();
+		mUpdateInputFirst = mInputFirst;
+		mUpdateInputEnd = mInputWritten;
+		mInputFirst = mInputWritten;
+
+		if (mUpdateInputFirst != mUpdateInputEnd && !mFrameInputNanoseconds) {
+			mFrameInputNanoseconds = mInputEvents[mUpdateInputFirst % MaxInputEvents].mNanoseconds;
+		}
+
+		if (mUpdater) {
+			PROFILE_SCOPE("Updater::Update");
+			mUpdater->Update();
+		}
+
+		// Presses have been seen, by this update at least
+		mMouseButtonsPressed = 0;
+		memset(mKeyPressed, 0, sizeof(mKeyPressed));
+	}
+
+	void Engine::Implementation::SetBatchesTime(uint64_t nanoseconds) {
+		const float seconds = NanosecondsToSeconds(nanoseconds);
+		for (auto& sprite_batch : mBatches) {
+			sprite_batch->setTime(seconds);
+		}
+	}
+
+	void Engine::Implementation::InitOffscreenTarget() {
+		glGenRenderbuffers(2, mOffscreenRenderbuffers);
+		glBindRenderbuffer(GL_RENDERBUFFER, mOffscreenRenderbuffers[0]);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, WindowWidth, WindowHeight);
+		glBindRenderbuffer(GL_RENDERBUFFER, mOffscreenRenderbuffers[1]);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, WindowWidth, WindowHeight);
+		glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+		glGenFramebuffers(1, &mOffscreenFramebuffer);
+		glBindFramebuffer(GL_FRAMEBUFFER, mOffscreenFramebuffer);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, mOffscreenRenderbuffers[0]);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, mOffscreenRenderbuffers[1]);
+
+		const GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+		if (status != GL_FRAMEBUFFER_COMPLETE) {
+			throw std::runtime_error(std::string("Error creating offscreen framebuffer, status ") + std::to_string(status));
+		}
+
+		// Stays bound, every frame is rendered into it
+		mGlContext->CheckError("Offscreen target create");
+	}
+
+	void Engine::Implementation::InitNullBatches(const std::string* texture_files, glm::vec4 viewport) {
+
+		// Textures are only read for their dimensions
+		for (size_t si = 0; si < Engine::IMAGE_MAX; ++si)
+		{
+			mTextures[si].reset(new SpriteTexture());
+			mTextures[si]->load(texture_files[si].c_str());
+		}
+
+		if (MergeBatches)
+		{
+			auto sprite_batch = std::make_shared<SpriteBatch>();
+			sprite_batch->initHeadless(Engine::CELL_MAX + Engine::DIAMOND_MAX + MAX_GLYPHS,
+				SpriteBatch::MAX_INSTANCES * Engine::IMAGE_MAX,
+				BatchInstanceFormat, SpriteBatch::eDM_MULTI_DRAW_INDIRECT);
+
+			sprite_batch->setCullMode(BatchCullMode);
+			sprite_batch->setViewport(viewport);
+
+			for (size_t si = 0; si < Engine::IMAGE_MAX; ++si) {
+				mBatches[si] = sprite_batch;
 			}
+
+			return;
+		}
+
+		for (size_t si = 0; si < Engine::IMAGE_MAX; ++si)
+		{
+			auto sprite_batch = std::make_shared<SpriteBatch>();
+			sprite_batch->initHeadless(GetMaxTemplates(si), SpriteBatch::MAX_INSTANCES, BatchInstanceFormat);
+
+			sprite_batch->setCullMode(BatchCullMode);
+			sprite_batch->setViewport(viewport);
+			mBatches[si] = sprite_batch;
 		}
 	}
 
@@ -532,42 +1376,88 @@ namespace King {
 		std::string texture_files[Engine::IMAGE_MAX] = {
 			assets_dir + "/textures/Cells.dds",
 			assets_dir + "/textures/fruits_128.dds",
-			assets_dir + "/textures/berlin_sans_demi_72_0.dds"
+			assets_dir + (DistanceFieldFont
+				? "/textures/berlin_sans_demi_72_sdf.dds"
+				: "/textures/berlin_sans_demi_72_0.dds")
 		};
 
 		std::string vert_shader_file = assets_dir + "/shaders/sprite.vert";
 		std::string frag_shader_file = assets_dir + "/shaders/sprite.frag";
-		std::string font_shader_file = assets_dir + "/shaders/font.frag";
+		std::string font_shader_file = assets_dir + (DistanceFieldFont
+			? "/shaders/font_sdf.frag"
+			: "/shaders/font.frag");
+		std::string cull_shader_file = assets_dir + "/shaders/cull.comp";
+
+		const glm::vec4 viewport(0.0f, 0.0f,
+			static_cast<float>(WindowWidth), static_cast<float>(WindowHeight));
+
+		if (mBackend == Engine::BACKEND_NULL) {
+			InitNullBatches(texture_files, viewport);
+			return;
+		}
 
 		glm::mat4 projection = glm::ortho(
 			0.0f, static_cast<float>(WindowWidth),
 			0.0f, static_cast<float>(WindowHeight), -1.0f, 1.0f);
 
+		if (MergeBatches)
+		{
+			const SpriteTexture* layers[Engine::IMAGE_MAX];
+			for (size_t si = 0; si < Engine::IMAGE_MAX; ++si)
+			{
+				mTextures[si].reset(new SpriteTexture());
+				mTextures[si]->create(texture_files[si].c_str());
+				layers[si] = mTextures[si].get();
+			}
+
+			mTextureArray.reset(new SpriteTextureArray());
+			mTextureArray->create(layers, Engine::IMAGE_MAX);
+
+			// The array holds a copy of the texels, the textures
+			// are only kept around for their dimensions.
+			for (size_t si = 0; si < Engine::IMAGE_MAX; ++si) {
+				mTextures[si]->destroy();
+			}
+
+			// Layers are drawn in image order, and the font layer
+			// is single channel, or a distance field, see sprite.frag.
+			auto sprite_batch = std::make_shared<SpriteBatch>();
+			sprite_batch->init(projection, mTextureArray->getTexId(),
+				vert_shader_file.c_str(), frag_shader_file.c_str(),
+				Engine::CELL_MAX + Engine::DIAMOND_MAX + MAX_GLYPHS,
+				SpriteBatch::MAX_INSTANCES * Engine::IMAGE_MAX,
+				BatchUploadMode, BatchInstanceFormat, BatchBufferBackend,
+				SpriteBatch::eDM_MULTI_DRAW_INDIRECT);
+
+			sprite_batch->setCullMode(BatchCullMode, cull_shader_file.c_str());
+			sprite_batch->setViewport(viewport);
+
+			for (size_t si = 0; si < Engine::IMAGE_MAX; ++si) {
+				mBatches[si] = sprite_batch;
+			}
+
+			return;
+		}
+
 		// Initialise textures and sprite batches
 		for (size_t si = 0; si < Engine::IMAGE_MAX; ++si)
 		{
 			auto* sprite_textrue = new SpriteTexture();
 			sprite_textrue->create(texture_files[si].c_str());
 
-			const char* frag_shader = frag_shader_file.c_str();
-			auto max_templates = SpriteBatch::MAX_TEMPLATES;
-			switch (si) {
-			case Engine::IMAGE_BACKGROUND:
-				max_templates = 4;
-				break;
-			case Engine::IMAGE_DIAMONDS:
-				max_templates = 8;
-				break;
-			case Engine::IMAGE_TEXT:
-				max_templates = MAX_GLYPHS;
-				frag_shader = font_shader_file.c_str();
-				break;
-			}
+			const char* frag_shader = (si == Engine::IMAGE_TEXT)
+				? font_shader_file.c_str()
+				: frag_shader_file.c_str();
+			const auto max_templates = GetMaxTemplates(si);
 
 			auto* sprite_batch = new SpriteBatch();
 			sprite_batch->init(projection, sprite_textrue->getTexId(),
 				vert_shader_file.c_str(), frag_shader,
-				max_templates, SpriteBatch::MAX_INSTANCES);
+				max_templates, SpriteBatch::MAX_INSTANCES,
+				BatchUploadMode, BatchInstanceFormat, BatchBufferBackend);
+
+			sprite_batch->setCullMode(BatchCullMode, cull_shader_file.c_str());
+			sprite_batch->setViewport(viewport);
 
 			// Add texture and sprite batch to the managed pointers
 			mTextures[si].reset(sprite_textrue);
@@ -575,6 +1465,26 @@ namespace King {
 		}
 	}
 
+	const SpriteBatch::Template& Engine::Implementation::CreateSpriteTemplate(Engine::Image image, glm::vec4 atlas_offsets) {
+
+		const uint32_t text_flags = DistanceFieldFont
+			? uint32_t(SpriteBatch::eTF_DISTANCE_FIELD)
+			: uint32_t(SpriteBatch::eTF_ALPHA_FROM_RED);
+
+		const uint32_t flags = (image == Engine::IMAGE_TEXT)
+			? text_flags
+			: uint32_t(SpriteBatch::eTF_NONE);
+
+		// Textures sit in the corner of their own layer
+		if (mTextureArray) {
+			const glm::vec2 layer_scale = mTextureArray->getLayerScale(image);
+			atlas_offsets *= glm::vec4(layer_scale, layer_scale);
+			return mBatches[image]->createTemplate(atlas_offsets, uint32_t(image), flags);
+		}
+
+		return mBatches[image]->createTemplate(atlas_offsets, 0, flags);
+	}
+
 	void Engine::Implementation::InitSpriteTemplates() {
 
 		// Generate background templates
@@ -584,7 +1494,7 @@ namespace King {
 
 			for (size_t c_it = 0; c_it < Engine::CELL_MAX; ++c_it) {
 				GetBackgroundTemplates().push_back(std::make_unique<SpriteBatch::Template>(
-					mBatches[Engine::IMAGE_BACKGROUND]->createTemplate(
+					CreateSpriteTemplate(Engine::IMAGE_BACKGROUND,
 						glm::vec4(c_it * x_step, 0.f, (c_it + 1) * x_step, 1.f))));
 			}
 		}
@@ -596,20 +1506,21 @@ namespace King {
 
 			for (size_t d_it = 0; d_it < Engine::DIAMOND_MAX; ++d_it) {
 				GetDiamondTemplates().push_back(std::make_unique<SpriteBatch::Template>(
-					mBatches[Engine::IMAGE_DIAMONDS]->createTemplate(
+					CreateSpriteTemplate(Engine::IMAGE_DIAMONDS,
 						glm::vec4(d_it * x_step, 0.f, (d_it + 1) * x_step, 1.f))));
 			}
 		}
 
-		// Cache font glyphs
+		// Cache font glyphs. Glyph rectangles refer to the full size atlas,
+		// the distance field one being a scaled down copy of it.
 		{
-			float fontTexWidth = static_cast<float>(mTextures[Engine::IMAGE_TEXT]->getWidth());
-			float fontTexHeight = static_cast<float>(mTextures[Engine::IMAGE_TEXT]->getHeight());
+			float fontTexWidth = static_cast<float>(FONT_ATLAS_WIDTH);
+			float fontTexHeight = static_cast<float>(FONT_ATLAS_HEIGHT);
 
 			int32_t advance = 0;
 			for (uint16_t c = 0; c < MAX_GLYPHS; ++c) {
 
-				Glyph& g = FindGlyph(static_cast<char>(c));
+				const Glyph& g = FindGlyph(static_cast<char>(c));
 
 				float uvLeft = static_cast<float>(g.x) / fontTexWidth;
 				float uvRight = static_cast<float>(g.x + g.width) / fontTexWidth;
@@ -617,7 +1528,7 @@ namespace King {
 				float uvTop = static_cast<float>(g.y + g.height) / fontTexHeight;
 
 				GetTextTemplates().push_back(std::make_unique<SpriteBatch::Template>(
-					mBatches[Engine::IMAGE_TEXT]->createTemplate(glm::vec4(uvLeft, uvBottom, uvRight, uvTop))));
+					CreateSpriteTemplate(Engine::IMAGE_TEXT, glm::vec4(uvLeft, uvBottom, uvRight, uvTop))));
 			}
 
 			mNextCharInstance = 0;
@@ -637,12 +1548,13 @@ namespace King {
 
 		// Create background cell instances
 		auto& templates = GetBackgroundTemplates();
+		mBackground.resize(n_cells);
 		for (int32_t i = 0; i < n_cells; ++i) {
 			const auto& sprite_template = templates[Engine::CELL_AVAILABLE];
 			mBackground[i] = sprite_batch->addInstance(*sprite_template);
 
 			// Step up into the columns
-			col_id = i % GetGridDims();
+			col_id = i % mGridColumns;
 			if (col_id == 0) {
 				row_id += 1;
 			}
@@ -653,27 +1565,33 @@ namespace King {
 			sprite_batch->updateInstance(mBackground[i], cell_pos, cell_size);
 		}
 
-		// Initialise diamond templates mapping
-		for (auto i = 0; i < GetNumOfGridCells(); ++i) {
-			mDiamondsTemplateMap[i] = Engine::DIAMOND_MAX;
-		}
+		// Initialise diamond instances and templates mapping
+		mDiamonds.assign(n_cells, SpriteBatch::Handle::INVALID);
+		mDiamondsTemplateMap.assign(n_cells, uint8_t(Engine::DIAMOND_MAX));
 
-		// Initialise text char instances
-		for (auto c = 0; c < MAX_CHARS; ++c) {
-			// All char instances are initialise with the null character '\0'
-			mTextChars[c] = GetTextBatch()->addInstance(*GetTextTemplates()[0]);
-		}
+		// Text char instances are paged in by Write, as needed
+		mTextChars.clear();
+		mNextCharInstance = 0;
 	}
 
 	void Engine::Implementation::ParseEvents() {
+		PROFILE_SCOPE("Engine::ParseEvents");
+		const uint64_t poll_nanoseconds = ClockNanoseconds();
 		SDL_Event event;
 		while (SDL_PollEvent(&event)) {
 			switch (event.type) {
 			case SDL_KEYDOWN: {
+				if (event.key.repeat) {
+					break;
+				}
+
 				if (event.key.keysym.sym < std::numeric_limits<uint8_t>::max()) {
 					mKeyDown[event.key.keysym.sym] = true;
+					mKeyPressed[event.key.keysym.sym] = true;
 				}
 
+				PushInputEvent(Engine::INPUT_KEY_DOWN, event.key.keysym.sym, event.key.timestamp, poll_nanoseconds);
+
 				if (event.key.keysym.sym == SDLK_ESCAPE) {
 					mQuit = true;
 				}
@@ -685,26 +1603,91 @@ namespace King {
 					mKeyDown[event.key.keysym.sym] = false;
 				}
 
+				PushInputEvent(Engine::INPUT_KEY_UP, event.key.keysym.sym, event.key.timestamp, poll_nanoseconds);
 				break;
 			}
 			case SDL_QUIT:
 				mQuit = true;
 				break;
 			case SDL_MOUSEBUTTONDOWN:
+				mMouseX = static_cast<float>(event.button.x);
+				mMouseY = static_cast<float>(event.button.y);
 				mMouseButtonsMask |= (1 << event.button.button);
-				mMouseButtonDown = true;
+				mMouseButtonsPressed |= (1 << event.button.button);
+				PushInputEvent(Engine::INPUT_MOUSE_DOWN, event.button.button, event.button.timestamp, poll_nanoseconds);
 				break;
 			case SDL_MOUSEBUTTONUP:
+				mMouseX = static_cast<float>(event.button.x);
+				mMouseY = static_cast<float>(event.button.y);
 				mMouseButtonsMask &= ~(1 << event.button.button);
-				mMouseButtonDown = false;
+				PushInputEvent(Engine::INPUT_MOUSE_UP, event.button.button, event.button.timestamp, poll_nanoseconds);
 				break;
 			case SDL_MOUSEMOTION:
 				mMouseX = static_cast<float>(event.motion.x);
 				mMouseY = static_cast<float>(event.motion.y);
+				PushInputEvent(Engine::INPUT_MOUSE_MOTION, 0, event.motion.timestamp, poll_nanoseconds);
 				break;
 			default:
 				break;
 			}
 		}
 	}
+
+	void Engine::Implementation::PushInputEvent(Engine::InputType type, int32_t code, uint32_t sdl_timestamp, uint64_t poll_nanoseconds) {
+
+		// SDL stamps events in milliseconds when queued, which places them
+		// back in time from the poll, never before the previous event.
+		const uint32_t age_milliseconds = SDL_GetTicks() - sdl_timestamp;
+		uint64_t nanoseconds = poll_nanoseconds - std::min<uint64_t>(uint64_t(age_milliseconds) * 1000000ull, poll_nanoseconds);
+		if (mInputWritten) {
+			nanoseconds = std::max(nanoseconds, mInputEvents[(mInputWritten - 1) % MaxInputEvents].mNanoseconds);
+		}
+
+		// Full, the oldest event waiting goes
+		if (mInputWritten - mInputFirst == MaxInputEvents) {
+			++mInputFirst;
+		}
+
+		Engine::InputEvent& input = mInputEvents[mInputWritten % MaxInputEvents];
+		input.mType = type;
+		input.mCode = code;
+		input.mMouseX = mMouseX;
+		input.mMouseY = mMouseY;
+		input.mNanoseconds = nanoseconds;
+
+		++mInputWritten;
+	}
+
+	bool Engine::Implementation::NeedsRedraw() const {
+
+		// Input gets a frame even if it changed nothing, hovering included
+		if (mFrameInputNanoseconds) {
+			return true;
+		}
+
+		for (size_t i = 0; i < Engine::IMAGE_MAX; ++i) {
+			if (!IsMergedBatch(i) && mBatches[i]->needsRedraw()) {
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	void Engine::Implementation::WaitForChange() {
+
+		PROFILE_SCOPE("Engine::WaitForChange");
+
+		// Input is already waiting for the next step, which is not due yet
+		if (SDL_HasEvents(SDL_FIRSTEVENT, SDL_LASTEVENT)) {
+			if (mFixedTimestep) {
+				const uint64_t step_due = FixedStepNanoseconds - std::min(mAccumulatedNanoseconds, FixedStepNanoseconds);
+				SDL_Delay(uint32_t(step_due / 1000000ull));
+			}
+
+			return;
+		}
+
+		SDL_WaitEventTimeout(nullptr, IdleWaitMilliseconds);
+	}
 }
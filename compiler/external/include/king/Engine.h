@@ -42,6 +42,14 @@ namespace King {
 		};
 
 
+		// Mirrors SpriteBatch::Easing
+		enum Easing {
+			EASE_LINEAR,
+			EASE_IN,
+			EASE_OUT,
+			EASE_IN_OUT
+		};
+
 		enum Image {
 			IMAGE_BACKGROUND,
 			IMAGE_DIAMONDS,
@@ -49,31 +57,110 @@ namespace King {
 			IMAGE_MAX
 		};
 
-		Engine(const char* assets_directory);
+		// Where frames go, fixed at construction.
+		// BACKEND_WINDOW presents them in a window, with vsync.
+		// BACKEND_OFFSCREEN renders them into a framebuffer object of the
+		// window size, the window is never shown nor swapped, and vsync is off.
+		// BACKEND_NULL creates no window nor GL context at all, the sprite
+		// batches keep doing all their CPU side work, but nothing is drawn.
+		enum Backend {
+			BACKEND_WINDOW,
+			BACKEND_OFFSCREEN,
+			BACKEND_NULL
+		};
+
+		enum InputType {
+			INPUT_KEY_DOWN,
+			INPUT_KEY_UP,
+			INPUT_MOUSE_DOWN,
+			INPUT_MOUSE_UP,
+			INPUT_MOUSE_MOTION
+		};
+
+		// Key code, or mouse button, and the mouse position at the time
+		struct InputEvent {
+			InputType mType;
+			int32_t mCode;
+			float mMouseX;
+			float mMouseY;
+			uint64_t mNanoseconds;
+		};
+
+		// The board is grid_width by grid_height cells, from 1 to 1024 each way
+		Engine(const char* assets_directory, Backend backend = BACKEND_WINDOW,
+			int32_t grid_width = 8, int32_t grid_height = 8);
 		~Engine();
 
+		// Time the current Update() advances the game by, a constant
+		// with the fixed timestep. The frame is rendered in between the
+		// last two steps, GetFrameInterpolation() being where, from 0 to 1.
 		float GetLastFrameSeconds() const;
+		float GetFrameInterpolation() const;
+		uint32_t GetLastFrameUploadedBytes() const;
 		float GetMouseX() const;
 		float GetMouseY() const;
+
+		// Buttons and keys pressed since the previous Update() count as down,
+		// however soon they were released.
 		bool IsMouseButtonDown(uint8_t index) const;
 		bool IsKeyDown(uint8_t key) const;
+
+		// Input received since the previous Update(), oldest first. Input is
+		// polled right before each Update(), and timestamped on the same clock
+		// as the frames, in nanoseconds.
+		size_t GetInputEventCount() const;
+		const InputEvent& GetInputEvent(size_t index) const;
+
+		// From the oldest input the last presented frame responded to, to its
+		// present, which, in a window, is when the swap returned.
+		float GetInputLatencySeconds() const;
 		
+		// Off by default. When on, a frame is only drawn if the updater changed
+		// any sprite or text, tweens are under way, or input arrived. Otherwise
+		// the engine sleeps until input comes, or the updater is due again.
+		void SetRenderOnDemand(bool enabled);
+
+		// Both off by default, and read by Start(). A fixed timestep updates in
+		// steps of 1/120s, as many as the frame took. A render thread draws
+		// each frame while the next one is built, the null backend never has one.
+		void SetFixedTimestep(bool enabled);
+		void SetRenderThread(bool enabled);
+
 		void Start(Updater& updater);
 		void Quit();
 
 		float Write(const char* text, glm::vec2 position, glm::vec4 color, float size, float rotation = 0);
 		void Erease();
 
+		// Retained text, laid out again only when any of its properties
+		// change, hence text that stays the same costs nothing per frame.
+		int32_t CreateText(const char* text, glm::vec2 position, glm::vec4 color, float size);
+		void SetText(int32_t text_id, const char* text);
+		void SetTextPosition(int32_t text_id, glm::vec2 position);
+		void SetTextColor(int32_t text_id, glm::vec4 color);
+		void SetTextSize(int32_t text_id, float size);
+		float GetTextWidth(int32_t text_id) const;
+		void DestroyText(int32_t text_id);
+
 		void ChangeCell(int32_t index, Background new_template);
 		void UpdateCell(int32_t index, glm::vec2 size, glm::vec4 color, float rotation);
 		
 		void GetDiamondData(int32_t index, glm::vec2& position, glm::vec2& size, glm::vec4& color, float& rotation) const;
 		void UpdateDiamond(int32_t index, glm::vec2 position, glm::vec2 size, glm::vec4 color, float rotation);
 		void MoveDiamond(int32_t index, glm::vec2 translate, glm::vec2 scale, float rotate);
+		void TweenDiamond(int32_t index, glm::vec2 position, glm::vec2 size, glm::vec4 color, float rotation, float duration, Easing easing = EASE_LINEAR);
+
+		// Back among the resting diamonds, once its tween is over
+		void SettleDiamond(int32_t index);
+
 		void ChangeDiamond(int32_t index, Diamond new_template);
 		void AddDiamond(int32_t index, Diamond diamond_template);
 		void RemoveDiamond(int32_t index);
 
+		// Hands the diamond of a full cell over to an empty one, the same
+		// sprite instance, left where it is drawn until moved or tweened.
+		void RelocateDiamond(int32_t from_index, int32_t to_index);
+
 		void AddFloatingDiamond(float x, float y, Diamond diamond_template);
 
 		int32_t GetCellIndex(int32_t screen_x, int32_t screen_y) const;
@@ -89,6 +176,9 @@ namespace King {
 
 		Diamond GetGridDiamond(int32_t index) const;
 
+		// Diamond of each cell, by grid index, DIAMOND_MAX where empty, see CellPlane.h
+		const uint8_t* GetDiamondPlane() const;
+
 		int32_t GetGridWidth() const;
 		int32_t GetGridHeight() const;
 
@@ -97,7 +187,7 @@ namespace King {
 
 	private:
 
-		float CalculateStringWidth(const char* text) const;
+		float CalculateStringWidth(const char* text, float size) const;
 
 		struct Implementation;
 		std::unique_ptr<Implementation> mPimpl;
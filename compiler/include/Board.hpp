@@ -0,0 +1,217 @@
+#pragma once
+
+#include <cstdint>
+#include <random>
+#include <vector>
+
+// The match three rules, as plain data, neither rendered nor timed by anything
+// but step(). What happens to the diamonds is reported as a stream of events,
+// for whoever draws the board to play back, or for no one at all.
+// Cells are indexed row * width + column, row 0 being the bottom one.
+class Board
+{
+
+public:
+
+	const static uint8_t	NO_COLOUR = 0xff;
+
+	enum class GameState
+	{
+		INVALID,
+		INIT,			// Game started, grid initialised, but match didn't begin yet.
+		MATCH_BEGUN,	// Match is begun
+		GRID_EXPLODING,	// Grid is resolving, moving, exploding, spawning
+		GRID_FALLING,	// Grid is resolving, moving, exploding, spawning
+		GRID_SPAWNING,	// Grid is resolving, moving, exploding, spawning
+		PLAYER_MOVING,	// Player is acting on the grid
+		PLAYER_WAITING, //Waiting for player's to move
+		MATCH_PAUSE,	// Match is in pause, (advantage for the player? we might want to hide the diamonds)
+		MATCH_END,		// The match ended, but the game is still running, waiting for the player to restart or quit
+		END				// Player quit
+	};
+
+	// When the grid is updating, one of the following states
+	// is set on at least one of diamonds, but all are in ready state.
+	enum class DiamondState : uint8_t
+	{
+		EMPTY,		// No diamond onto the requested grid cell
+		READY,		// Diamond is in its ready state
+		SPAWNING,	// Diamond is spawning (moving from the top?)
+		SWAPPING,	// Diamond has been requested to be swapped
+		DRAGGED,	// Diamond is being moved by the player
+		EXPLOD,		// Diamond needs to explode
+		SELECTED,	// Diamond has been selected
+		FALLING,	// Diamond is falling
+		UPDATING,	// Diamond is updating
+	};
+
+	// What the events of a step are about.
+	// eET_ADD puts a diamond of mColour in the cell mIndex.
+	// eET_REMOVE takes the diamond of mIndex away, exploded or cleared.
+	// eET_FALL moves the diamond of mIndex down to mTarget, over mDuration.
+	// eET_SWAP exchanges the diamonds of mIndex and mTarget, over mDuration.
+	// eET_STATE changes the state of the diamond of mIndex to mState.
+	// eET_MATCH_BEGIN and eET_MATCH_END are about the match as a whole.
+	enum EventType
+	{
+		eET_ADD,
+		eET_REMOVE,
+		eET_FALL,
+		eET_SWAP,
+		eET_STATE,
+		eET_MATCH_BEGIN,
+		eET_MATCH_END
+	};
+
+	struct Event
+	{
+		EventType		mType;
+		int32_t			mIndex;
+		int32_t			mTarget;
+		uint8_t			mColour;
+		DiamondState	mState;
+		float			mDuration;
+	};
+
+	// Colours go from 0 to mColours - 1, times are in seconds.
+	// Spawn weights are relative, one per colour and one per column,
+	// left empty the spawns are uniform.
+	struct Rules
+	{
+		int32_t		mWidth = 8;
+		int32_t		mHeight = 8;
+		int32_t		mColours = 5;
+		int32_t		mMatchLength = 3;	// cells of a run that explodes
+		int32_t		mInitHeight = 4;	// highest a column is filled at the start
+		float		mFallingTime = 1.5f;
+		float		mSwappingTime = 0.6f;
+		float		mSpawnTime = 1.0f;	// a diamond spawns this often
+		float		mMatchTime = 90.f;
+
+		std::vector<double>	mColourWeights;
+		std::vector<double>	mColumnWeights;
+	};
+
+	// What the player did since the previous step
+	struct Input
+	{
+		int32_t		mPick = -1;			// cell clicked, -1 if none
+		bool		bStart = false;
+		bool		bRestart = false;
+	};
+
+	Board(const Rules& rules, uint32_t seed);
+
+	// Clears the grid and fills its first rows at random, ahead of a match
+	void fill();
+
+	// Advances the match by dt seconds
+	void step(float dt, const Input& input);
+
+	// Of the last step(), or fill(), in the order they happened
+	const std::vector<Event>& getEvents() const { return mEvents; }
+
+	// Row-major planes, NO_COLOUR where empty
+	const uint8_t* getColours() const { return mColours.data(); }
+	const DiamondState* getStates() const { return mStates.data(); }
+
+	const Rules& getRules() const { return mRules; }
+	int32_t getWidth() const { return mRules.mWidth; }
+	int32_t getHeight() const { return mRules.mHeight; }
+	int32_t getSize() const { return mRules.mWidth * mRules.mHeight; }
+
+	bool isValidIndex(int32_t index) const { return index >= 0 && index < getSize(); }
+	int32_t getIndex(int32_t column, int32_t row) const { return row * mRules.mWidth + column; }
+	int32_t getRow(int32_t index) const { return index / mRules.mWidth; }
+	int32_t getColumn(int32_t index) const { return index % mRules.mWidth; }
+
+	uint8_t getColour(int32_t index) const { return mColours[index]; }
+	DiamondState getState(int32_t index) const { return mStates[index]; }
+
+	GameState getGameState() const { return mGameState; }
+	bool isMatching() const;
+
+	// All the diamonds are ready, none of them being moved
+	bool isGridReady() const { return mBusyCells == 0; }
+
+	float getRoundTime() const { return mRoundTime; }
+	float getMatchTime() const { return mMatchTime; }
+	uint32_t getScore() const { return mScore; }
+	uint32_t getLastScore() const { return mLastScore; }
+
+	// Moves the player made, and runs exploded, since the board was made
+	uint64_t getSwapCount() const { return mSwapCount; }
+	uint64_t getExplosionCount() const { return mExplosionCount; }
+
+private:
+
+	// A diamond falling down its column, by distance rows
+	struct FallingMove
+	{
+		int32_t		mFrom;
+		int32_t		mTo;
+		int32_t		mDistance;
+	};
+
+	// Diamonds being moved, ready again once their life is over
+	struct Tween
+	{
+		int32_t		mIndex;
+		float		mLife;
+	};
+
+	void pushEvent(EventType type, int32_t index, int32_t target = -1, float duration = 0.f);
+
+	void setState(int32_t index, DiamondState state);
+	void addDiamond(int32_t index, uint8_t colour);
+	void removeDiamond(int32_t index);
+
+	void clearGrid();
+	void fillGrid();
+	void restartMatch();
+
+	bool checkAdjacencies();
+	void resolveExplosions();
+	bool checkPick(int32_t pick);
+	bool isAdjacent(int32_t a, int32_t b) const;
+	void swapDiamonds(int32_t first, int32_t second);
+	void compactColumns();
+	bool checkFalling();
+	void advanceTweens(float dt);
+	void spawnDiamond();
+
+	Rules						mRules;
+	std::mt19937				mRandom;
+
+	// Of the spawn weights, if any
+	std::discrete_distribution<int32_t>	mSpawnColours;
+	std::discrete_distribution<int32_t>	mSpawnColumns;
+
+	std::vector<uint8_t>		mColours;
+	std::vector<DiamondState>	mStates;
+
+	// Byte planes, 0xff for the cells in READY or EXPLOD state, kept
+	// along with the states, and for the cells of the runs found.
+	std::vector<uint8_t>		mMatchableCells;
+	std::vector<uint8_t>		mMatchedCells;
+
+	// Cells neither empty nor ready
+	int32_t						mBusyCells;
+
+	std::vector<Tween>			mTweens;
+
+	// Filled by compactColumns, along with the lowest row of each column still to fill
+	std::vector<FallingMove>	mFallingMoves;
+	std::vector<int32_t>		mColumnFloors;
+
+	std::vector<Event>			mEvents;
+
+	GameState					mGameState;
+	float						mRoundTime;
+	float						mMatchTime;
+	uint32_t					mScore;
+	uint32_t					mLastScore;
+	int32_t						mPickIndex;
+	uint64_t					mSwapCount;
+	uint64_t					mExplosionCount;
+};
@@ -12,8 +12,8 @@ private:
 
 public:
 
-	// Tessellation, geometry and compute
-	// stages are here for reference only.
+	// Tessellation and geometry stages are here for
+	// reference only, compute is used by sprite culling.
 	enum StageType
 	{
 		eST_VERTEX,
@@ -0,0 +1,76 @@
+#pragma once
+
+// Comment out to compile the profiler, and all of its markers, to nothing
+#define PROFILING
+
+#ifdef PROFILING
+
+#include <cstdint>
+
+// Frame profiler. CPU scopes are recorded into a buffer of the thread they
+// run on, GPU scopes are timed by GL_TIME_ELAPSED queries, which are only
+// read back once available, frames later, so that nothing waits for them.
+// What has been recorded can be written out as a Chrome trace, which loads
+// into about:tracing.
+class Profiler
+{
+
+public:
+
+	// Names have to outlive the profiler, string literals are expected
+	static void beginCpuScope(const char* name);
+	static void endCpuScope();
+
+	// GL_TIME_ELAPSED queries can't nest, neither can the GPU scopes.
+	// They have to be used on the thread the context is current on.
+	static void beginGpuScope(const char* name);
+	static void endGpuScope();
+
+	// Read back the queries done so far, once per frame on the context thread
+	static void collectGpuScopes();
+
+	// Before the context goes, pending scopes are dropped
+	static void releaseGpuScopes();
+
+	// Names the calling thread in the trace
+	static void setThreadName(const char* name);
+
+	// Threads must not record while writing, false if the file can't be written
+	static bool writeChromeTrace(const char* filename);
+
+	class CpuScope
+	{
+	public:
+		explicit CpuScope(const char* name) { beginCpuScope(name); }
+		~CpuScope() { endCpuScope(); }
+	};
+
+	class GpuScope
+	{
+	public:
+		explicit GpuScope(const char* name) { beginGpuScope(name); }
+		~GpuScope() { endGpuScope(); }
+	};
+
+};
+
+#define PROFILE_CONCAT_(a, b)		a##b
+#define PROFILE_CONCAT(a, b)		PROFILE_CONCAT_(a, b)
+
+#define PROFILE_SCOPE(name)			Profiler::CpuScope PROFILE_CONCAT(profile_scope_, __LINE__)(name)
+#define PROFILE_GPU_SCOPE(name)		Profiler::GpuScope PROFILE_CONCAT(profile_gpu_scope_, __LINE__)(name)
+#define PROFILE_COLLECT_GPU()		Profiler::collectGpuScopes()
+#define PROFILE_RELEASE_GPU()		Profiler::releaseGpuScopes()
+#define PROFILE_THREAD(name)		Profiler::setThreadName(name)
+#define PROFILE_WRITE(filename)		Profiler::writeChromeTrace(filename)
+
+#else
+
+#define PROFILE_SCOPE(name)
+#define PROFILE_GPU_SCOPE(name)
+#define PROFILE_COLLECT_GPU()
+#define PROFILE_RELEASE_GPU()
+#define PROFILE_THREAD(name)
+#define PROFILE_WRITE(filename)		false
+
+#endif
@@ -11,7 +11,10 @@ public:
 
 	// Expects a list of shader source files per stage.
 	// A null pointer if the stage should not be taken into account.
+	// Optional defines (i.e. "#define NAME VALUE\n" lines) are injected
+	// right after the #version directive of every stage.
 	static GraphicsPipeline buildFromFiles(
-		std::array<const char*, GraphicsPipeline::StageType::eST_MAX> filenames);
+		std::array<const char*, GraphicsPipeline::StageType::eST_MAX> filenames,
+		const char* defines = nullptr);
 
 };
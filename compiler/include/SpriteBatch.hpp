@@ -11,6 +11,9 @@
 #include <vector>
 #include <queue>
 #include <memory>
+#include <string>
+
+typedef struct __GLsync* GLsync;
 
 class SpriteBatch
 {
@@ -21,6 +24,8 @@ public:
 	const static size_t	MAX_VERTICES = 6;
 	const static size_t	MAX_TEMPLATES = 16;
 	const static size_t	MAX_INSTANCES = 256;
+	const static size_t	RING_FRAMES = 3;
+	const static size_t	MAX_SLOTS = size_t(1) << 24;	// slot ids fill the low 24 bits of the sort keys
 
 	enum Uniform
 	{
@@ -28,13 +33,95 @@ public:
 		eUBO_TEMPLATE,
 		eUBO_INSTANCE,
 		eUBO_DATA,
+		eUBO_TWEEN,
 		eUBO_MAX
 	};
 
+	// How the instance buffers reach the GPU.
+	// eUM_MAP_INVALIDATE maps and invalidates the whole buffer each time it is dirty.
+	// eUM_PERSISTENT_RING keeps the buffers persistently mapped and splits them in
+	// RING_FRAMES slices, each one guarded by a fence, so the CPU can write the next
+	// slice while the GPU is still reading the previous ones. It falls back to
+	// eUM_MAP_INVALIDATE if ARB_buffer_storage is not available.
+	enum UploadMode
+	{
+		eUM_MAP_INVALIDATE,
+		eUM_PERSISTENT_RING
+	};
+
+	// Layout of the per instance data streamed to the GPU.
+	// eIF_MATRIX stores the full transform and colour, 80 bytes.
+	// eIF_COMPACT stores position, rotation, half float scale and RGBA8
+	// colour, 20 bytes, and the vertex shader rebuilds the transform.
+	enum InstanceFormat
+	{
+		eIF_MATRIX,
+		eIF_COMPACT
+	};
+
+	// Where instances and their data live on the GPU.
+	// eBB_UNIFORM sizes the uniform blocks once, at init, after max_sprites.
+	// eBB_STORAGE uses shader storage blocks, which are unsized in the shader,
+	// hence the batch doubles its capacity whenever it runs out of instances.
+	// It falls back to eBB_UNIFORM if the vertex stage can't access storage blocks.
+	enum BufferBackend
+	{
+		eBB_UNIFORM,
+		eBB_STORAGE
+	};
+
+	// How the instances are submitted by draw(). Either way instances
+	// are drawn in sort key order, that is by layer, depth and template.
+	// eDM_INSTANCED draws all the instances with a single instanced draw.
+	// eDM_MULTI_DRAW_INDIRECT draws the layers in order with one
+	// glMultiDrawArraysIndirect, one command per layer. The bound texture
+	// is expected to be a 2D array, each layer of it sampled by the
+	// templates of the same layer.
+	enum DrawMode
+	{
+		eDM_INSTANCED,
+		eDM_MULTI_DRAW_INDIRECT
+	};
+
+	// Easing curves of the instance tweens, mirrored by sprite.vert
+	enum Easing
+	{
+		eEC_LINEAR,
+		eEC_EASE_IN,
+		eEC_EASE_OUT,
+		eEC_EASE_IN_OUT
+	};
+
+	// Which instances draw() submits, see setViewport().
+	// eCM_NONE submits them all.
+	// eCM_CPU bins the instance bounds into a uniform grid, tests the cells
+	// the viewport overlaps with SSE, and uploads the visible instances only.
+	// eCM_GPU uploads all of them, and a compute pass compacts the visible
+	// ones and writes the instance counts of the indirect draw. It requires
+	// eIF_COMPACT and eBB_STORAGE, and falls back to eCM_CPU otherwise.
+	// Bounds are conservative, a sprite is tested as the circle around its
+	// rotation centre, and a tweening one as the union of its start and end.
+	enum CullMode
+	{
+		eCM_NONE,
+		eCM_CPU,
+		eCM_GPU
+	};
+
+	// How the fragment shader treats the texels of a template
+	enum TemplateFlags
+	{
+		eTF_NONE = 0,
+		eTF_ALPHA_FROM_RED = 1 << 0,	// single channel atlas, as the font one
+		eTF_DISTANCE_FIELD = 1 << 1		// single channel signed distance field atlas
+	};
+
 	struct Template
 	{
 		const glm::vec4	mVBO[MAX_VERTICES];
 		const uint32_t	mTemplateId;
+		const uint32_t	mLayer;
+		const uint32_t	mFlags;
 		
 		static Template INVALID;
 		static const size_t VBO_SIZE = sizeof(glm::vec4) * MAX_VERTICES;
@@ -43,8 +130,11 @@ public:
 			return mTemplateId != INDEX_NONE;
 		}
 
-		Template(const glm::vec4* vbo, const uint32_t id)
+		Template(const glm::vec4* vbo, const uint32_t id,
+			const uint32_t layer = 0, const uint32_t flags = eTF_NONE)
 			: mTemplateId(id)
+			, mLayer(layer)
+			, mFlags(flags)
 		{
 			if (vbo) {
 				memcpy(const_cast<glm::vec4*>(mVBO), vbo, VBO_SIZE);
@@ -52,69 +142,162 @@ public:
 		}
 	};
 
-	// This doesn't store the transform by design,
-	// as we don't want the user to modify it directly.
+	// GPU side record of an instance, which template to draw
+	// and where to fetch its data from. It is plain data, kept
+	// contiguous, so it can be uploaded with a single copy.
+	// Layer and flags are copied from the template.
 	struct Instance
 	{
-		static Instance INVALID;
+		uint32_t	mTemplateId;
+		uint32_t	mDataId;
+		uint32_t	mLayer;
+		uint32_t	mFlags;
+	};
+
+	// Reference to an instance, as returned by addInstance().
+	// The index points into the sparse slot table, the generation is
+	// bumped every time a slot is released, so a stale handle is
+	// detected instead of silently aliasing a newer instance.
+	struct Handle
+	{
+		uint32_t	mIndex;
+		uint32_t	mGeneration;
+
+		static const Handle INVALID;
 
 		inline bool isValid() const {
-			return mTemplateId != INDEX_NONE && mDataId != INDEX_NONE;
+			return mIndex != uint32_t(INDEX_NONE);
 		}
 
-		inline Instance(uint32_t template_id, uint32_t transform_id)
-			: mTemplateId(template_id), mDataId(transform_id) {
+		inline bool operator==(const Handle& other) const {
+			return mIndex == other.mIndex && mGeneration == other.mGeneration;
 		}
 
-	private:
-
-		friend class SpriteBatch;
-		uint32_t	mTemplateId;
-		uint32_t		mDataId;
-		uint32_t		mPad[2];
+		inline bool operator!=(const Handle& other) const {
+			return !(*this == other);
+		}
 	};
 
 	bool init(glm::mat4 projection, uint32_t texture_id,
 		const char* vs_source, const char* fs_source,
-		size_t max_templates, size_t max_sprites);
+		size_t max_templates, size_t max_sprites,
+		UploadMode upload_mode = eUM_MAP_INVALIDATE,
+		InstanceFormat instance_format = eIF_MATRIX,
+		BufferBackend buffer_backend = eBB_UNIFORM,
+		DrawMode draw_mode = eDM_INSTANCED);
+
+	// Batch without any GL object, for the null renderer. Instances are
+	// stored, sorted, culled and encoded as usual, and the bytes that would
+	// have been uploaded are accounted for, but nothing reaches the GPU.
+	// Its capacity grows as with eBB_STORAGE, and eCM_GPU falls back to eCM_CPU.
+	bool initHeadless(size_t max_templates, size_t max_sprites,
+		InstanceFormat instance_format = eIF_MATRIX,
+		DrawMode draw_mode = eDM_INSTANCED);
 
 	void release();
 
+	// Select which instances get drawn, by default all of them.
+	// @param cs_source culling compute shader, only used by eCM_GPU
+	// @return false if the mode fell back to another one
+	bool setCullMode(CullMode cull_mode, const char* cs_source = nullptr);
+
+	// Visible area in world space, x=left, y=bottom, z=right, w=top
+	void setViewport(glm::vec4 viewport);
+
 	// Generates the VBO containing vertex positions and texture coordinates
 	// @param atlas_offsets defined as x=left, y=top, z=right, w=bottom
-	const Template& createTemplate(glm::vec4 atlas_offsets);
+	// @param layer texture array layer in eDM_MULTI_DRAW_INDIRECT mode,
+	// and the first criterion of the draw order in any mode
+	// @param flags combination of TemplateFlags
+	const Template& createTemplate(glm::vec4 atlas_offsets,
+		uint32_t layer = 0, uint32_t flags = eTF_NONE);
 
 	// Swap instance template with the provided one
-	bool swapInstanceTemplate(std::shared_ptr<Instance>& instance, const Template& new_template);
+	bool swapInstanceTemplate(Handle instance, const Template& new_template);
 
 	// Add an instance of template to the sprite's batch
-	// @return The ref index of the instance, SpriteKey.mTemplate == null otherwise
-	std::shared_ptr<Instance> addInstance(const Template& template_ref);
+	// @return The handle of the instance, Handle::INVALID otherwise
+	Handle addInstance(const Template& template_ref);
 
-	// Remove the instance from the set and decrement the control pointer
-	void removeInstance(const std::shared_ptr<Instance>& sprite_ref);
+	// Remove the instance from the set and release its handle
+	void removeInstance(Handle instance);
+
+	// Instances of the same layer with greater depth are drawn on top
+	bool setInstanceDepth(Handle instance, uint16_t depth);
+	uint16_t getInstanceDepth(Handle instance) const;
+
+	// Whether the handle still refers to a live instance of this batch
+	bool isValidInstance(Handle instance) const;
 
 	// Update instance transform
-	bool updateInstance(const std::shared_ptr<Instance>& sprite_ref,
+	bool updateInstance(Handle instance,
 		glm::vec2 position = glm::vec2(0.f),
 		glm::vec2 scale = glm::vec2(1.f),
 		glm::vec4 color = glm::vec4(1.f),
 		float rotation = 0.f);
 
+	// Tween the instance from its current state to the given one.
+	// With eIF_COMPACT the tween is evaluated by the vertex shader, hence
+	// it costs one upload when it starts, and nothing while it runs.
+	// With eIF_MATRIX it is evaluated at flush time instead.
+	// The instance keeps the end state once the tween is over, and any
+	// updateInstance() call cancels it.
+	// @param start_time batch time, as given to setTime(), the tween starts at
+	// @param duration in seconds, anything but positive updates the instance straight away
+	bool tweenInstance(Handle instance,
+		glm::vec2 position, glm::vec2 scale, glm::vec4 color, float rotation,
+		float start_time, float duration, Easing easing = eEC_LINEAR);
+
+	// Whether the instance tween has not reached its end state yet
+	bool isInstanceTweening(Handle instance) const;
+
+	// Time tweens are evaluated at, in seconds, set it once per frame
+	void setTime(float seconds) { mTime = seconds; }
+	float getTime() const { return mTime; }
+
 	// Flush pending uniform buffers
 	void flushBuffers();
 
 	// Draw all instances in once
-	void draw() const;
+	void draw();
+
+	// Whether a frame drawn now would differ from the last one drawn,
+	// either because the batch changed, or tweens are still under way.
+	bool needsRedraw() const;
+
+	// What flushBuffers() would upload, and draw() would read, copied
+	// out of the batch, so that the frame can be submitted on the thread
+	// owning the GL context while the batch is already being changed.
+	class FramePacket;
+
+	// From now on GL is only touched by submitFramePacket(), growing the
+	// buffers included, which is deferred until the next packet gets there.
+	void setThreaded(bool threaded);
+
+	// Same as flushBuffers(), except that uploads are recorded into the packet
+	void buildFramePacket(FramePacket& packet);
+
+	// Upload and draw a packet, packets have to be submitted in the order
+	// they were built, on the thread the GL context is current on.
+	void submitFramePacket(const FramePacket& packet);
+
+	// Number of bytes uploaded by the last flushBuffers() call
+	size_t getUploadedBytes() const { return mUploadedBytes; }
+
+	// Number of instances submitted by the last eCM_CPU cull, all of them otherwise
+	size_t getVisibleCount() const;
 
-	// Get instance info
-	glm::vec2 getInstancePosition(const std::shared_ptr<Instance>& instance) const;
-	glm::vec2 getInstanceSize(const std::shared_ptr<Instance>& instance) const;
-	float getInstanceRotation(const std::shared_ptr<Instance>& instance) const;
-	glm::vec4 getInstanceColor(const std::shared_ptr<Instance>& instance) const;
+	// Number of instances the batch can hold before growing, if it can
+	size_t getCapacity() const { return mMaxInstances; }
+
+	// Get instance info, as of the current time if tweening
+	glm::vec2 getInstancePosition(Handle instance) const;
+	glm::vec2 getInstanceSize(Handle instance) const;
+	float getInstanceRotation(Handle instance) const;
+	glm::vec4 getInstanceColor(Handle instance) const;
 
 	// Returns the instance template
-	const Template& getInstanceTemplate(const std::shared_ptr<Instance>& instance) const;
+	const Template& getInstanceTemplate(Handle instance) const;
 
 private:
 
@@ -123,26 +306,320 @@ private:
 	uint32_t	mTexId;
 	uint32_t	mVAO;
 	uint32_t	mUBO[eUBO_MAX];
+	uint32_t	mBufferType[eUBO_MAX];
 
 	size_t	mMaxTemplates;
 	size_t	mMaxInstances;
 
+	BufferBackend	mBufferBackend;
+	bool			bHeadless;
+
+	// With a render thread, packets are recorded rather than uploaded, and
+	// the device buffers lag behind the batch capacity until submitted.
+	FramePacket*	mRecording;
+	bool			bThreaded;
+	size_t			mDeviceCapacity;
+	size_t			mMaxBlockSize[eUBO_MAX];
+	size_t			mBlockAlignment[eUBO_MAX];
+
+	// The draw list holds the instance records in sort key order, it is
+	// what gets uploaded to the instance buffer. With multi draw, sprite.vert
+	// reads it through the per instance DrawID attribute, which, unlike
+	// gl_InstanceID, accounts for the base instance of each command.
+	struct DrawCommand
+	{
+		uint32_t	mCount;
+		uint32_t	mInstanceCount;
+		uint32_t	mFirst;
+		uint32_t	mBaseInstance;
+	};
+
+	// Everything draw() reads off the batch, captured at flush time
+	struct FrameState
+	{
+		float		mTime;
+		size_t		mRingIndex;
+		glm::vec4	mViewport;
+		size_t		mInstanceCount;
+		size_t		mCullCount;
+		size_t		mLayerCount;
+		size_t		mCommandCount;
+	};
+
+	DrawMode					mDrawMode;
+	uint32_t					mNumLayers;
+	uint32_t					mIndirectBuffer;
+	uint32_t					mDrawIdBuffer;
+	std::vector<Instance>		mDrawList;
+	std::vector<DrawCommand>	mDrawCommands;
+	bool						bDirtyDrawList;
+
+	// Sort key of each dense instance, from the most significant bits:
+	// layer (8), depth (16), template (16) and slot (24). The slot makes
+	// the keys unique, so the order doesn't depend on the dense order.
+	struct SortItem
+	{
+		uint64_t	mKey;
+		uint32_t	mDenseId;
+	};
+
+	std::vector<uint64_t>	mSortKeys;
+	std::vector<SortItem>	mSortItems;
+	std::vector<SortItem>	mSortScratch;
+
+	// Culling state. mBounds holds the conservative bounds of each dense
+	// instance, as x=left, y=bottom, z=right, w=top. The grid stores, cell
+	// after cell, the bounds of the instances overlapping each cell, as SoA,
+	// so four of them are tested at once. mGridOffsets[c] is where the
+	// entries of cell c start, the last one being the total entry count.
+	CullMode				mCullMode;
+	glm::vec4				mViewport;
+	bool					bDirtyBounds;
+	bool					bDirtyVisibility;
+	std::vector<glm::vec4>	mBounds;
+	std::vector<uint8_t>	mVisible;
+	std::vector<Instance>	mVisibleList;
+
+	glm::vec2				mGridOrigin;
+	float					mGridCellSize;
+	uint32_t				mGridWidth;
+	uint32_t				mGridHeight;
+	std::vector<uint32_t>	mGridOffsets;
+	std::vector<uint32_t>	mGridIds;
+	std::vector<float>		mGridMinX;
+	std::vector<float>		mGridMinY;
+	std::vector<float>		mGridMaxX;
+	std::vector<float>		mGridMaxY;
+
+	// eCM_GPU compute passes, counting the visible instances of each group,
+	// then compacting them into mVisibleBuffer, read by draw() instead of
+	// the instance buffer. The indirect commands are written by the passes.
+	std::string			mShaderDefines;
+	GraphicsPipeline	mCullCountPipe;
+	GraphicsPipeline	mCullCompactPipe;
+	uint32_t			mVisibleBuffer;
+	uint32_t			mGroupCountBuffer;
+	size_t				mIndirectSize;
+
+	// Persistent ring state, only used by eUM_PERSISTENT_RING
+	UploadMode	mUploadMode;
+	uint8_t*	mMappedPtr[eUBO_MAX];
+	size_t		mSliceSize[eUBO_MAX];
+	GLsync		mFences[RING_FRAMES];
+	size_t		mRingIndex;
+
 	struct Data
 	{
 		glm::mat4 mTransform;
 		glm::vec4 mColor;
 	};
 
-	std::vector<Template>					mTemplates;
-	std::vector<Data>						mData;
-	std::vector<std::shared_ptr<Instance>>	mInstances;
+	// Mirrors the words fetched by the COMPACT_DATA path of sprite.vert
+	struct CompactData
+	{
+		glm::vec2	mPosition;
+		uint32_t	mScale;		// packHalf2x16
+		float		mRotation;
+		uint32_t	mColor;		// packUnorm4x8
+	};
+
+	static_assert(sizeof(CompactData) == 5 * sizeof(uint32_t),
+		"CompactData has to match COMPACT_WORDS in sprite.vert");
 
-	// Dirty templates and instances flags
+	InstanceFormat	mInstanceFormat;
+	size_t			mDataStride;
+
+	// Buffers streamed from the dense arrays, in the instance format
+	std::vector<Uniform>	mStreamedBuffers;
+
+	// Sparse entry of the handle table. While in use mDense is the
+	// position of the instance in the dense arrays, once released
+	// it links to the next free slot.
+	struct Slot
+	{
+		uint32_t	mDense;
+		uint32_t	mGeneration;
+	};
+
+	std::vector<Template>	mTemplates;
+
+	// Dense arrays, all of them indexed by the same position.
+	// The SoA store below is authoritative, whereas mData holds its
+	// GPU encoding, one record of mDataStride bytes per instance,
+	// which is rebuilt at flush time for the stale instances only.
+	std::vector<Instance>	mInstances;
+	std::vector<glm::vec2>	mPositions;
+	std::vector<glm::vec2>	mScales;
+	std::vector<float>		mRotations;
+	std::vector<glm::vec4>	mColors;
+	std::vector<uint8_t>	mData;
+	std::vector<uint32_t>	mDenseToSlot;
+
+	// Tween of each instance, a zero duration means none. The start
+	// state is the one in the SoA store, the end state is kept here.
+	struct Tween
+	{
+		glm::vec2	mPosition;
+		glm::vec2	mScale;
+		glm::vec4	mColor;
+		float		mRotation;
+		float		mStartTime;
+		float		mDuration;
+		Easing		mEasing;
+	};
+
+	// Mirrors the words fetched by the tween path of sprite.vert
+	struct TweenData
+	{
+		glm::vec2	mPosition;
+		uint32_t	mScale;		// packHalf2x16
+		float		mRotation;
+		uint32_t	mColor;		// packUnorm4x8
+		float		mStartTime;
+		float		mDuration;
+		uint32_t	mEasing;
+	};
+
+	static_assert(sizeof(TweenData) == 8 * sizeof(uint32_t),
+		"TweenData has to match TWEEN_WORDS in sprite.vert");
+
+	std::vector<Tween>		mTweens;
+	std::vector<TweenData>	mTweenData;
+	float					mTime;
+
+	// When the last tween started ends, and the time last drawn at
+	float					mTweensEnd;
+	float					mDrawnTime;
+
+	// Sparse handle table and its free list, sized at init
+	std::vector<Slot>		mSlots;
+	uint32_t				mFreeSlot;
+
+	// Coalesced range of elements [mBegin, mEnd) waiting to be uploaded
+	struct DirtyRange
+	{
+		size_t mBegin;
+		size_t mEnd;
+
+		inline bool isEmpty() const {
+			return mBegin >= mEnd;
+		}
+
+		inline void reset() {
+			mBegin = INDEX_NONE;
+			mEnd = 0;
+		}
+
+		inline void add(size_t first, size_t count) {
+			mBegin = first < mBegin ? first : mBegin;
+			mEnd = first + count > mEnd ? first + count : mEnd;
+		}
+	};
+
+	// Dirty templates flag and instance ranges.
 	// These will be caught next time flushBuffer() is called
-	// which, in turn will update the relevant buffers
-	uint8_t	bDirtyTemplates : 1;
-	uint8_t bDirtyInstances : 1;
+	// which, in turn will update the relevant buffers.
+	// Each ring slice keeps its own ranges, as it has to catch up
+	// with all the changes happened since it was last written.
+	uint8_t		bDirtyTemplates : 1;
+	DirtyRange	mDirtyRanges[RING_FRAMES][eUBO_MAX];
+
+	// Instances whose GPU record is out of date with the SoA store
+	DirtyRange	mStaleRange;
+
+	size_t	mUploadedBytes;
+
+	void markDirty(Uniform buffer, size_t first, size_t count = 1);
+
+	// Dense position of a live instance, INDEX_NONE otherwise
+	size_t getDenseIndex(Handle instance) const;
+
+	// Encode the instance state in the batch instance format
+	void encodeData(size_t data_id);
+	void encodeStaleData();
+	void encodeTween(size_t data_id);
+
+	// Instance state at the current time
+	void evaluateInstance(size_t data_id, glm::vec2& position,
+		glm::vec2& scale, glm::vec4& color, float& rotation) const;
+
+	// CPU side tweens, used by eIF_MATRIX only
+	void advanceTweens();
+
+	// Where the streamed buffers are uploaded from, and how many elements
+	const uint8_t* getBufferSource(Uniform buffer, size_t& elem_size, size_t& elem_count) const;
+	size_t getElementSize(Uniform buffer) const;
+
+	static uint64_t makeSortKey(uint32_t layer, uint16_t depth, uint32_t template_id, uint32_t slot_id);
+
+	// Sort the instances by key, and rebuild the draw commands
+	void buildDrawList();
+	void buildDrawCommands(const std::vector<Instance>& draw_list);
+	void uploadDrawCommands(const std::vector<DrawCommand>& commands);
+
+	// eCM_CPU, rebuild the bounds grid if needed, and compact the draw list
+	void computeBounds();
+	void buildCullGrid();
+	void cullInstances();
+
+	// eCM_GPU, run the compute passes ahead of the draw
+	void allocateCullBuffers(size_t capacity);
+	void dispatchCulling(const FrameState& state);
+
+	// CPU side state, shared by init() and initHeadless()
+	void initStreamedBuffers();
+	void initInstances();
+
+	FrameState captureFrameState() const;
+	void drawFrame(const FrameState& state);
+	void bindInstanceBuffers(size_t ring_index);
+
+	// Write to the GPU, or to the packet being recorded if any
+	void uploadRange(Uniform buffer, size_t ring_index, size_t offset, const uint8_t* source, size_t size);
+	void writeRange(Uniform buffer, size_t ring_index, size_t offset, const uint8_t* source, size_t size);
 
 	void fillTemplatesBuffer();
 	void fillInstancesBuffer();
+	void fillInstancesRing();
+
+	// Reallocate the storage buffers, and carry their content over
+	bool growInstanceBuffers(size_t new_capacity);
+	bool fitsDeviceCapacity(size_t capacity) const;
+	bool growDeviceBuffers(size_t new_capacity, size_t used_count);
+	void reserveDeviceCapacity(size_t capacity);
+};
+
+// Packets own their bytes, and keep their capacity once cleared,
+// hence reusing them doesn't allocate once they are big enough.
+class SpriteBatch::FramePacket
+{
+
+public:
+
+	void clear();
+
+	// Bytes recorded for upload
+	size_t getSize() const { return mBytes.size(); }
+
+private:
+
+	friend class SpriteBatch;
+
+	struct Upload
+	{
+		Uniform	mBuffer;
+		size_t	mOffset;	// within the buffer, or its ring slice
+		size_t	mSize;
+		size_t	mSource;	// within mBytes
+	};
+
+	std::vector<Upload>			mUploads;
+	std::vector<uint8_t>		mBytes;
+	std::vector<DrawCommand>	mCommands;
+	FrameState					mState;
+	size_t						mCapacity;
+	bool						bNewCommands;
+	bool						bWriteSlice;
+
+	void record(Uniform buffer, size_t offset, const uint8_t* source, size_t size);
 };
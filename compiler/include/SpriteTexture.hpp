@@ -18,6 +18,10 @@ public:
 	~SpriteTexture();
 
 	bool create(const char* filename);
+
+	// Read the surface only, no GL texture is created
+	bool load(const char* filename);
+
 	void destroy();
 	void use(uint32_t texture_unit);
 
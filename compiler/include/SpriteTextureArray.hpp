@@ -0,0 +1,41 @@
+#pragma once
+
+#include <glm/vec2.hpp>
+
+#include <cstdint>
+#include <vector>
+
+class SpriteTexture;
+
+// Packs several sprite textures into the layers of one GL_TEXTURE_2D_ARRAY,
+// so that sprites from different atlases can be drawn without rebinding.
+// The atlases can differ in size and compression format, hence every layer
+// is decompressed to RGBA8 and placed at the origin of a layer as big as the
+// largest atlas. Texture coordinates have to be scaled by getLayerScale().
+class SpriteTextureArray
+{
+
+public:
+
+	~SpriteTextureArray();
+
+	bool create(const SpriteTexture* const* textures, size_t count);
+	void destroy();
+
+	int32_t getWidth() const { return mWidth; }
+	int32_t getHeight() const { return mHeight; }
+	size_t getLayers() const { return mLayerScales.size(); }
+
+	// Portion of the layer covered by the original texture
+	glm::vec2 getLayerScale(size_t layer) const;
+
+	inline uint32_t getTexId() const { return mTextureId; }
+
+private:
+
+	uint32_t				mTextureId;
+	int32_t					mWidth;
+	int32_t					mHeight;
+	std::vector<glm::vec2>	mLayerScales;
+
+};
@@ -0,0 +1,424 @@
+#include "Board.hpp"
+#include "format.hpp"
+
+#include <king/CellPlane.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <stdexcept>
+
+namespace
+{
+	// Either none, or one non negative weight per choice, not all of them zero
+	bool areValidWeights(const std::vector<double>& weights, int32_t choices)
+	{
+		if (weights.empty()) {
+			return true;
+		}
+
+		double sum = 0.0;
+		for (const double weight : weights) {
+			if (!(weight >= 0.0)) {
+				return false;
+			}
+			sum += weight;
+		}
+
+		return weights.size() == size_t(choices) && sum > 0.0;
+	}
+
+	// Cells taken by a diamond that can't be picked, nor matched, right now
+	bool isBusy(Board::DiamondState state)
+	{
+		return state != Board::DiamondState::EMPTY && state != Board::DiamondState::READY;
+	}
+}
+
+Board::Board(const Rules& rules, uint32_t seed)
+	: mRules(rules)
+	, mRandom(seed)
+	, mSpawnColours(rules.mColourWeights.begin(), rules.mColourWeights.end())
+	, mSpawnColumns(rules.mColumnWeights.begin(), rules.mColumnWeights.end())
+	, mBusyCells(0)
+	, mGameState(GameState::INVALID)
+	, mRoundTime(rules.mSpawnTime)
+	, mMatchTime(rules.mMatchTime)
+	, mScore(0)
+	, mLastScore(0)
+	, mPickIndex(-1)
+	, mSwapCount(0)
+	, mExplosionCount(0)
+{
+	if (rules.mWidth < 1 || rules.mHeight < 1) {
+		throw std::runtime_error(fmt::format(
+			"Invalid board of {}x{} cells\n", rules.mWidth, rules.mHeight));
+	}
+
+	if (rules.mColours < 1 || rules.mColours >= NO_COLOUR || rules.mMatchLength < 1) {
+		throw std::runtime_error(fmt::format(
+			"Invalid board of {} colours, matching {} in a row\n", rules.mColours, rules.mMatchLength));
+	}
+
+	if (!areValidWeights(rules.mColourWeights, rules.mColours)
+		|| !areValidWeights(rules.mColumnWeights, rules.mWidth)) {
+		throw std::runtime_error(fmt::format(
+			"Invalid spawn weights, {} for {} colours and {} for {} columns\n",
+			rules.mColourWeights.size(), rules.mColours, rules.mColumnWeights.size(), rules.mWidth));
+	}
+
+	const size_t cells = size_t(getSize());
+	mColours.assign(cells, uint8_t(NO_COLOUR));
+	mStates.assign(cells, DiamondState::EMPTY);
+	mMatchableCells.assign(cells, 0x00);
+	mMatchedCells.assign(cells, 0x00);
+	mColumnFloors.assign(size_t(rules.mWidth), 0);
+}
+
+void Board::fill()
+{
+	mEvents.clear();
+	fillGrid();
+}
+
+void Board::step(float dt, const Input& input)
+{
+	mEvents.clear();
+
+	// Check the player wants to restart the match
+	if (isMatching() && input.bRestart) {
+		restartMatch();
+	}
+
+	// Check whether the match started
+	if (!isMatching() && input.bStart) {
+		mGameState = GameState::MATCH_BEGUN;
+		pushEvent(eET_MATCH_BEGIN, -1);
+	}
+
+	if (!isMatching()) {
+		return;
+	}
+
+	// Runs explode before the pick, which can only take ready diamonds
+	if (checkAdjacencies()) {
+		resolveExplosions();
+		mGameState = GameState::GRID_EXPLODING;
+	}
+
+	if (checkPick(input.mPick)) {
+		mGameState = GameState::PLAYER_MOVING;
+	}
+
+	// Exploded diamonds leave holes for the ones above to fall into
+	if (checkFalling()) {
+		mGameState = GameState::GRID_FALLING;
+	}
+
+	if (!mTweens.empty()) {
+		advanceTweens(dt);
+	}
+
+	// Waiting for the player to make a move
+	if (isGridReady()) {
+		mTweens.clear();
+		mGameState = GameState::PLAYER_WAITING;
+	}
+
+	mRoundTime -= dt;
+	mMatchTime -= dt;
+
+	if (mRoundTime <= 0.f) {
+		mRoundTime = mRules.mSpawnTime;
+		spawnDiamond();
+	}
+
+	if (mMatchTime <= 0.f) {
+		mMatchTime = mRules.mMatchTime;
+		restartMatch();
+	}
+}
+
+bool Board::isMatching() const
+{
+	return mGameState >= GameState::MATCH_BEGUN && mGameState < GameState::MATCH_END;
+}
+
+void Board::pushEvent(EventType type, int32_t index, int32_t target, float duration)
+{
+	Event event;
+	event.mType = type;
+	event.mIndex = index;
+	event.mTarget = target;
+	event.mColour = isValidIndex(index) ? mColours[index] : uint8_t(NO_COLOUR);
+	event.mState = isValidIndex(index) ? mStates[index] : DiamondState::EMPTY;
+	event.mDuration = duration;
+	mEvents.push_back(event);
+}
+
+void Board::setState(int32_t index, DiamondState state)
+{
+	assert(isValidIndex(index));
+	const DiamondState previous = mStates[index];
+	if (previous == state) {
+		return;
+	}
+
+	mBusyCells += int32_t(isBusy(state)) - int32_t(isBusy(previous));
+	mStates[index] = state;
+
+	const bool matchable = state == DiamondState::READY || state == DiamondState::EXPLOD;
+	mMatchableCells[index] = matchable ? 0xff : 0x00;
+
+	pushEvent(eET_STATE, index);
+}
+
+void Board::addDiamond(int32_t index, uint8_t colour)
+{
+	assert(isValidIndex(index) && colour < mRules.mColours);
+	mColours[index] = colour;
+	pushEvent(eET_ADD, index);
+}
+
+void Board::removeDiamond(int32_t index)
+{
+	assert(isValidIndex(index));
+	if (mColours[index] != NO_COLOUR) {
+		pushEvent(eET_REMOVE, index);
+		mColours[index] = NO_COLOUR;
+	}
+}
+
+void Board::clearGrid()
+{
+	for (int32_t i = 0; i < getSize(); ++i) {
+		removeDiamond(i);
+		setState(i, DiamondState::EMPTY);
+	}
+
+	mTweens.clear();
+}
+
+void Board::fillGrid()
+{
+	clearGrid();
+
+	// Restart round timer
+	mRoundTime = mRules.mSpawnTime;
+	mMatchTime = mRules.mMatchTime;
+	mScore = 0;
+	mPickIndex = -1;
+
+	std::uniform_int_distribution<int32_t> row_dis(0, std::min(mRules.mInitHeight, mRules.mHeight));
+	std::uniform_int_distribution<int32_t> colour_dis(0, mRules.mColours - 1);
+
+	// Fill first max rows, per column
+	for (int32_t c = 0; c < mRules.mWidth; ++c) {
+
+		const int32_t rows = row_dis(mRandom);
+		for (int32_t r = 0; r < rows; ++r) {
+
+			const int32_t index = getIndex(c, r);
+			addDiamond(index, uint8_t(colour_dis(mRandom)));
+			setState(index, DiamondState::READY);
+		}
+	}
+
+	mGameState = GameState::INIT;
+}
+
+void Board::restartMatch()
+{
+	mLastScore = mScore;
+	fillGrid();
+	mGameState = GameState::MATCH_END;
+	pushEvent(eET_MATCH_END, -1);
+}
+
+// Mark the diamonds of runs of mMatchLength or more of the same colour,
+// along rows and columns, those in READY or EXPLOD state only.
+bool Board::checkAdjacencies()
+{
+	std::fill(mMatchedCells.begin(), mMatchedCells.end(), uint8_t(0));
+	if (!King::FindPlaneRuns(mColours.data(), mMatchableCells.data(), mMatchedCells.data(),
+		mRules.mWidth, mRules.mHeight, mRules.mMatchLength)) {
+		return false;
+	}
+
+	for (int32_t i = 0; i < getSize(); ++i) {
+		if (mMatchedCells[i]) {
+			setState(i, DiamondState::EXPLOD);
+		}
+	}
+
+	return true;
+}
+
+void Board::resolveExplosions()
+{
+	uint32_t n_explosions = 0;
+	for (int32_t i = 0; i < getSize(); ++i) {
+
+		if (mStates[i] == DiamondState::EXPLOD) {
+			setState(i, DiamondState::EMPTY);
+			removeDiamond(i);
+			++n_explosions;
+		}
+	}
+
+	// Player scoring is exponential, the more
+	// explosions in one tick the more the points
+	mScore += n_explosions * n_explosions;
+	mExplosionCount += n_explosions;
+}
+
+// Only ready diamonds can be picked. Picking one next to the diamond
+// selected before swaps the two, anywhere else moves the selection.
+bool Board::checkPick(int32_t pick)
+{
+	if (!isValidIndex(pick)) {
+		return false;
+	}
+
+	// The selection is gone if its diamond exploded, or fell
+	const bool selected = isValidIndex(mPickIndex) && mStates[mPickIndex] == DiamondState::SELECTED;
+
+	if (mStates[pick] == DiamondState::READY)
+	{
+		if (selected && isAdjacent(pick, mPickIndex)) {
+			swapDiamonds(pick, mPickIndex);
+			mPickIndex = -1;
+			return true;
+		}
+
+		if (selected) {
+			setState(mPickIndex, DiamondState::READY);
+		}
+
+		setState(pick, DiamondState::SELECTED);
+		mPickIndex = pick;
+		return true;
+	}
+
+	// Invalidate previous selection if necessary
+	if (isValidIndex(mPickIndex) && pick != mPickIndex) {
+		if (selected) {
+			setState(mPickIndex, DiamondState::READY);
+		}
+
+		mPickIndex = -1;
+	}
+
+	return true;
+}
+
+bool Board::isAdjacent(int32_t a, int32_t b) const
+{
+	return std::abs(getRow(a) - getRow(b)) + std::abs(getColumn(a) - getColumn(b)) == 1;
+}
+
+// As long as they are swapping, neither of the two can explode
+void Board::swapDiamonds(int32_t first, int32_t second)
+{
+	pushEvent(eET_SWAP, first, second, mRules.mSwappingTime);
+	std::swap(mColours[first], mColours[second]);
+
+	mTweens.push_back(Tween{ first, mRules.mSwappingTime });
+	mTweens.push_back(Tween{ second, mRules.mSwappingTime });
+
+	setState(first, DiamondState::SWAPPING);
+	setState(second, DiamondState::SWAPPING);
+	++mSwapCount;
+}
+
+// Work out where the diamonds fall to, each column compacted down over its empty
+// cells. A single pass over the rows, bottom up, as a diamond falls to the lowest
+// cell of its column not taken by the ones below it.
+void Board::compactColumns()
+{
+	mFallingMoves.clear();
+	std::fill(mColumnFloors.begin(), mColumnFloors.end(), 0);
+
+	for (int32_t y = 0; y < mRules.mHeight; ++y) {
+		for (int32_t x = 0; x < mRules.mWidth; ++x) {
+
+			const int32_t index = getIndex(x, y);
+			if (mStates[index] == DiamondState::EMPTY) {
+				continue;
+			}
+
+			int32_t& floor = mColumnFloors[x];
+			if (floor < y) {
+				mFallingMoves.push_back(FallingMove{ index, getIndex(x, floor), y - floor });
+			}
+
+			++floor;
+		}
+	}
+}
+
+bool Board::checkFalling()
+{
+	compactColumns();
+
+	// Moves of a column go bottom up, each one into a cell already empty
+	for (const FallingMove& move : mFallingMoves) {
+
+		pushEvent(eET_FALL, move.mFrom, move.mTo, mRules.mFallingTime);
+		mColours[move.mTo] = mColours[move.mFrom];
+		mColours[move.mFrom] = NO_COLOUR;
+
+		setState(move.mTo, DiamondState::UPDATING);
+		setState(move.mFrom, DiamondState::EMPTY);
+		mTweens.push_back(Tween{ move.mTo, mRules.mFallingTime });
+	}
+
+	return !mFallingMoves.empty();
+}
+
+// Diamonds are ready again at the end of their tween, unless gone meanwhile
+void Board::advanceTweens(float dt)
+{
+	for (size_t i = 0; i < mTweens.size(); ++i) {
+
+		Tween& tween = mTweens[i];
+		bool done = mStates[tween.mIndex] == DiamondState::EMPTY;
+
+		if (!done) {
+			tween.mLife -= dt;
+			if (tween.mLife <= 0.f) {
+				setState(tween.mIndex, DiamondState::READY);
+				done = true;
+			}
+		}
+
+		// Swap with the last, which has to be evaluated next
+		if (done) {
+			mTweens[i--] = mTweens.back();
+			mTweens.pop_back();
+		}
+	}
+}
+
+// Spawn a new diamond in the top row of a random column, unless it is full.
+// Columns and colours are drawn by their weights, uniformly without.
+void Board::spawnDiamond()
+{
+	std::uniform_int_distribution<int32_t> column_dis(0, mRules.mWidth - 1);
+	std::uniform_int_distribution<int32_t> colour_dis(0, mRules.mColours - 1);
+
+	const int32_t column = mRules.mColumnWeights.empty() ? column_dis(mRandom) : mSpawnColumns(mRandom);
+	const int32_t index = getIndex(column, mRules.mHeight - 1);
+	if (mStates[index] != DiamondState::EMPTY) {
+		return;
+	}
+
+	const int32_t colour = mRules.mColourWeights.empty() ? colour_dis(mRandom) : mSpawnColours(mRandom);
+	addDiamond(index, uint8_t(colour));
+
+	// Special case when there is no dropping position available
+	const bool resting = mRules.mHeight < 2
+		|| mStates[getIndex(column, mRules.mHeight - 2)] != DiamondState::EMPTY;
+
+	setState(index, resting ? DiamondState::READY : DiamondState::SPAWNING);
+}
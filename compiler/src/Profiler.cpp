@@ -0,0 +1,236 @@
+#include "Profiler.hpp"
+
+#ifdef PROFILING
+
+#include "OGL.hpp"
+
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace
+{
+	// Beyond that, events are counted as dropped rather than recorded
+	const size_t MAX_THREAD_EVENTS = 1 << 20;
+
+	// Thread id the GPU scopes are shown as
+	const uint32_t GPU_THREAD_ID = 0;
+
+	struct Event
+	{
+		const char*	mName;
+		uint64_t	mBegin;		// nanoseconds
+		uint64_t	mDuration;
+	};
+
+	// Only its own thread writes to it, and it outlives the thread
+	struct ThreadBuffer
+	{
+		uint32_t			mId;
+		std::string			mName;
+		std::vector<Event>	mEvents;
+		std::vector<size_t>	mOpenScopes;
+		size_t				mDropped;
+	};
+
+	struct GpuQuery
+	{
+		const char*	mName;
+		uint64_t	mBegin;		// CPU time the commands were issued at
+		gl::uint32	mQuery;
+	};
+
+	const auto gClockStart = std::chrono::steady_clock::now();
+
+	std::mutex gThreadsMutex;
+	std::vector<std::unique_ptr<ThreadBuffer>> gThreads;
+
+	// Owned by the context thread
+	ThreadBuffer gGpuBuffer = { GPU_THREAD_ID, "GPU", {}, {}, 0 };
+	std::deque<GpuQuery> gPendingQueries;
+	std::vector<gl::uint32> gFreeQueries;
+	bool bGpuScopeOpen = false;
+
+	uint64_t now()
+	{
+		return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now() - gClockStart).count());
+	}
+
+	ThreadBuffer& threadBuffer()
+	{
+		// Registered on first use, thread ids start after the GPU one
+		thread_local ThreadBuffer* buffer = nullptr;
+		if (!buffer)
+		{
+			std::lock_guard<std::mutex> lock(gThreadsMutex);
+			gThreads.emplace_back(new ThreadBuffer());
+
+			buffer = gThreads.back().get();
+			buffer->mId = uint32_t(gThreads.size());
+			buffer->mName = "Thread " + std::to_string(buffer->mId);
+			buffer->mDropped = 0;
+			buffer->mEvents.reserve(4096);
+		}
+
+		return *buffer;
+	}
+
+	void recordEvent(ThreadBuffer& buffer, const char* name, uint64_t begin, uint64_t duration)
+	{
+		if (buffer.mEvents.size() < MAX_THREAD_EVENTS) {
+			buffer.mEvents.push_back(Event{ name, begin, duration });
+		}
+		else {
+			++buffer.mDropped;
+		}
+	}
+
+	// Complete events, in microseconds, plus the name of the thread
+	void writeEvents(FILE* file, const ThreadBuffer& buffer, bool& first)
+	{
+		fprintf(file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+			first ? "" : ",", buffer.mId, buffer.mName.c_str());
+		first = false;
+
+		for (const Event& event : buffer.mEvents)
+		{
+			fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+				event.mName, buffer.mId, double(event.mBegin) * 1e-3, double(event.mDuration) * 1e-3);
+		}
+
+		if (buffer.mDropped) {
+			fprintf(stderr, "Profiler: %s dropped %zu events\n", buffer.mName.c_str(), buffer.mDropped);
+		}
+	}
+}
+
+void Profiler::beginCpuScope(const char* name)
+{
+	ThreadBuffer& buffer = threadBuffer();
+
+	// Dropped scopes still have to be matched by their end
+	buffer.mOpenScopes.push_back(buffer.mEvents.size());
+	recordEvent(buffer, name, now(), 0);
+}
+
+void Profiler::endCpuScope()
+{
+	ThreadBuffer& buffer = threadBuffer();
+	assert(!buffer.mOpenScopes.empty());
+
+	const size_t event = buffer.mOpenScopes.back();
+	buffer.mOpenScopes.pop_back();
+
+	if (event < buffer.mEvents.size()) {
+		buffer.mEvents[event].mDuration = now() - buffer.mEvents[event].mBegin;
+	}
+}
+
+void Profiler::beginGpuScope(const char* name)
+{
+	assert(!bGpuScopeOpen);
+
+	// Queries are recycled once read back
+	gl::uint32 query(0);
+	if (gFreeQueries.empty()) {
+		glGenQueries(1, &query);
+	}
+	else {
+		query = gFreeQueries.back();
+		gFreeQueries.pop_back();
+	}
+
+	glBeginQuery(GL_TIME_ELAPSED, query);
+	gPendingQueries.push_back(GpuQuery{ name, now(), query });
+	bGpuScopeOpen = true;
+}
+
+void Profiler::endGpuScope()
+{
+	assert(bGpuScopeOpen);
+
+	glEndQuery(GL_TIME_ELAPSED);
+	bGpuScopeOpen = false;
+}
+
+void Profiler::collectGpuScopes()
+{
+	// Queries complete in order, stop at the first one still in flight
+	while (!gPendingQueries.empty())
+	{
+		// The scope still open, if any, is the last one
+		const GpuQuery& pending = gPendingQueries.front();
+		if (bGpuScopeOpen && &pending == &gPendingQueries.back()) {
+			break;
+		}
+
+		gl::int32 available(0);
+		glGetQueryObjectiv(pending.mQuery, GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available) {
+			break;
+		}
+
+		// Shown from when the commands were issued, GPU and CPU clocks differ
+		gl::uint64 elapsed(0);
+		glGetQueryObjectui64v(pending.mQuery, GL_QUERY_RESULT, &elapsed);
+		recordEvent(gGpuBuffer, pending.mName, pending.mBegin, uint64_t(elapsed));
+
+		gFreeQueries.push_back(pending.mQuery);
+		gPendingQueries.pop_front();
+	}
+}
+
+void Profiler::releaseGpuScopes()
+{
+	for (const GpuQuery& pending : gPendingQueries) {
+		gFreeQueries.push_back(pending.mQuery);
+	}
+
+	gPendingQueries.clear();
+	bGpuScopeOpen = false;
+
+	if (!gFreeQueries.empty())
+	{
+		glDeleteQueries(gl::sizei(gFreeQueries.size()), gFreeQueries.data());
+		gFreeQueries.clear();
+	}
+}
+
+void Profiler::setThreadName(const char* name)
+{
+	threadBuffer().mName = name;
+}
+
+bool Profiler::writeChromeTrace(const char* filename)
+{
+	FILE* file = fopen(filename, "w");
+	if (!file) {
+		return false;
+	}
+
+	fprintf(file, "{\"traceEvents\":[");
+
+	bool first = true;
+	writeEvents(file, gGpuBuffer, first);
+	{
+		std::lock_guard<std::mutex> lock(gThreadsMutex);
+		for (const auto& buffer : gThreads) {
+			writeEvents(file, *buffer, first);
+		}
+	}
+
+	fprintf(file, "\n]}\n");
+
+	const bool written = !ferror(file);
+	fclose(file);
+
+	return written;
+}
+
+#endif
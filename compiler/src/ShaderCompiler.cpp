@@ -128,10 +128,28 @@ namespace gl
 
 		return text;
 	}
+
+	// The #version directive must come first, defines go just after it
+	void injectDefines(std::string& shader_source, const char* defines)
+	{
+		if (defines && *defines)
+		{
+			size_t insert_at = 0;
+			const size_t version_at = shader_source.find("#version");
+			if (version_at != std::string::npos)
+			{
+				const size_t line_end = shader_source.find('\n', version_at);
+				insert_at = (line_end != std::string::npos) ? line_end + 1 : shader_source.length();
+			}
+
+			shader_source.insert(insert_at, defines);
+		}
+	}
 }
 
 GraphicsPipeline ShaderCompiler::buildFromFiles(
-	std::array<const char*, GraphicsPipeline::StageType::eST_MAX> filenames)
+	std::array<const char*, GraphicsPipeline::StageType::eST_MAX> filenames,
+	const char* defines)
 {
 	GraphicsPipeline graphics_pipeline;
 	graphics_pipeline.generate(true);
@@ -146,6 +164,7 @@ GraphicsPipeline ShaderCompiler::buildFromFiles(
 		{
 			// Load source code from file
 			auto shader_source = gl::loadSource(file_name);
+			gl::injectDefines(shader_source, defines);
 
 			// Create the relevant shader
 			gl::uint32 shader_name = gl::createShader(
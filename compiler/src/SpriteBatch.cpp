@@ -2,21 +2,22 @@
 #include "ShaderCompiler.hpp"
 #include "OGL.hpp"
 #include "format.hpp"
+#include "Profiler.hpp"
 
 #include <glm/vec3.hpp>
 #include <glm/gtc/quaternion.hpp>
 #include <glm/gtc/matrix_transform.hpp>
-#include <glm/gtx/matrix_decompose.hpp>
+#include <glm/packing.hpp>
+#include <glm/geometric.hpp>
 
 #include <cassert>
 #include <cmath>
 #include <algorithm>
+#include <iterator>
 #include <memory>
 #include <utility>
 #include <exception>
-
-#define BUFFER_TYPE GL_UNIFORM_BUFFER
-//#define BUFFER_TYPE GL_SHADER_STORAGE_BUFFER
+#include <xmmintrin.h>
 
 namespace
 {
@@ -47,15 +48,124 @@ namespace
 		return radians * 180.0f / PI;
 	}
 
-	gl::uint32 initBuffer(gl::enumerator buff_type, int32_t size, bool dynamic)
+	// Location of the time uniform in sprite.vert, and in cull.comp
+	const gl::int32 TIME_UNIFORM_LOCATION = 0;
+
+	// Locations of the other uniforms of cull.comp
+	const gl::int32 VIEWPORT_UNIFORM_LOCATION = 1;
+	const gl::int32 COUNT_UNIFORM_LOCATION = 2;
+	const gl::int32 LAYERS_UNIFORM_LOCATION = 3;
+
+	// Storage bindings of cull.comp, past the ones shared with sprite.vert
+	const gl::uint32 VISIBLE_BINDING = SpriteBatch::eUBO_MAX;
+	const gl::uint32 GROUPS_BINDING = SpriteBatch::eUBO_MAX + 1;
+	const gl::uint32 COMMANDS_BINDING = SpriteBatch::eUBO_MAX + 2;
+
+	// Work group size of cull.comp
+	const size_t CULL_GROUP_SIZE = 256;
+
+	// World units covered by a cell of the culling grid, cells grow
+	// past it when the grid would be wider than MAX_CULL_GRID_DIM.
+	const float CULL_CELL_SIZE = 128.f;
+	const uint32_t MAX_CULL_GRID_DIM = 256;
+
+	// Cells [first, last] the interval [lower, upper] overlaps along an axis
+	inline void cellSpan(float lower, float upper, float origin, float cell_size,
+		uint32_t cells, uint32_t& first, uint32_t& last)
 	{
-		gl::int32 buffer_offeset(0);
-		glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &buffer_offeset);
+		const float last_cell = float(cells - 1);
+		first = uint32_t(glm::clamp(std::floor((lower - origin) / cell_size), 0.f, last_cell));
+		last = uint32_t(glm::clamp(std::floor((upper - origin) / cell_size), 0.f, last_cell));
+	}
+
+	// Bounds as x=left, y=bottom, z=right, w=top
+	inline bool overlaps(const glm::vec4& a, const glm::vec4& b)
+	{
+		return a.x <= b.z && b.x <= a.z && a.y <= b.w && b.y <= a.w;
+	}
+
+	// Buffers streamed from the dense instance arrays, tweens last, as only
+	// the compact format reads them, see SpriteBatch::initStreamedBuffers()
+	const SpriteBatch::Uniform StreamedBuffers[] = {
+		SpriteBatch::eUBO_INSTANCE,
+		SpriteBatch::eUBO_DATA,
+		SpriteBatch::eUBO_TWEEN
+	};
+
+	// LSD radix sort on 64 bits keys, 8 bits per pass, which is stable.
+	// Passes over a byte all the keys share are skipped, as they would
+	// not change the order. Items and scratch, both holding count elements,
+	// are swapped after each pass, items pointing to the sorted ones at last.
+	template <typename Item>
+	void radixSort(Item*& items, Item*& scratch, size_t count)
+	{
+		size_t histogram[256];
+
+		for (size_t shift = 0; count > 1 && shift < 64; shift += 8)
+		{
+			memset(histogram, 0, sizeof(histogram));
+			for (size_t i = 0; i < count; ++i) {
+				++histogram[(items[i].mKey >> shift) & 0xff];
+			}
+
+			if (histogram[(items[0].mKey >> shift) & 0xff] == count) {
+				continue;
+			}
+
+			size_t offset = 0;
+			for (size_t bi = 0; bi < 256; ++bi) {
+				const size_t bucket_size = histogram[bi];
+				histogram[bi] = offset;
+				offset += bucket_size;
+			}
+
+			for (size_t i = 0; i < count; ++i) {
+				scratch[histogram[(items[i].mKey >> shift) & 0xff]++] = items[i];
+			}
+
+			std::swap(items, scratch);
+		}
+	}
+
+	// Same curves as ease() in sprite.vert
+	float applyEasing(float t, SpriteBatch::Easing easing)
+	{
+		switch (easing)
+		{
+		case SpriteBatch::eEC_EASE_IN:
+			return t * t;
+		case SpriteBatch::eEC_EASE_OUT:
+			return t * (2.f - t);
+		case SpriteBatch::eEC_EASE_IN_OUT:
+			return t < 0.5f ? 2.f * t * t : -1.f + (4.f - 2.f * t) * t;
+		default:
+			return t;
+		}
+	}
 
-		gl::int32 max_buffer_size(0);
-		glGetIntegerv(GL_MAX_UNIFORM_BLOCK_SIZE, &max_buffer_size);
+	// uniform and shader storage blocks have different limits
+	gl::int64 getMaxBlockSize(gl::enumerator buff_type)
+	{
+		gl::int64 max_buffer_size(0);
+		glGetInteger64v(buff_type == GL_SHADER_STORAGE_BUFFER
+			? GL_MAX_SHADER_STORAGE_BLOCK_SIZE
+			: GL_MAX_UNIFORM_BLOCK_SIZE, &max_buffer_size);
+		return max_buffer_size;
+	}
+
+	size_t alignedBufferSize(gl::enumerator buff_type, size_t size)
+	{
+		gl::int32 buffer_offeset(0);
+		glGetIntegerv(buff_type == GL_SHADER_STORAGE_BUFFER
+			? GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT
+			: GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &buffer_offeset);
+		return nextMultipleOf(size, buffer_offeset);
+	}
 
-		gl::int32 required_buffer_size = (gl::int32)nextMultipleOf(size, buffer_offeset);
+	gl::uint32 initBuffer(gl::enumerator buff_type, size_t size, bool dynamic)
+	{
+		const gl::int64 max_buffer_size = getMaxBlockSize(buff_type);
+		const gl::int64 required_buffer_size = (gl::int64)alignedBufferSize(buff_type, size);
 		const auto buffer_size = std::min(required_buffer_size, max_buffer_size);
 
 		if (buffer_size < required_buffer_size) {
@@ -69,12 +179,62 @@ namespace
 		glBindBuffer(buff_type, ubo);
 
 		auto buffer_usage = dynamic ? GL_DYNAMIC_DRAW : GL_STATIC_DRAW;
-		glBufferData(buff_type, buffer_size, nullptr, buffer_usage);
+		glBufferData(buff_type, (GLsizeiptr)buffer_size, nullptr, buffer_usage);
+		glBindBuffer(buff_type, 0);
+
+		return ubo;
+	}
+
+	// Immutable storage, mapped once for the whole lifetime of the buffer.
+	// Each of the slices is bound separately, hence it is the slice, not the
+	// entire buffer, that has to fit into a uniform block.
+	gl::uint32 initPersistentBuffer(gl::enumerator buff_type, size_t slice_size, size_t slices, uint8_t*& mapped_ptr)
+	{
+		const gl::int64 max_buffer_size = getMaxBlockSize(buff_type);
+
+		if (gl::int64(slice_size) > max_buffer_size) {
+			throw std::runtime_error(fmt::format(
+				"Cannot create buffer slice of size {} bytes, maximum allowed {} bytes\n",
+				slice_size, max_buffer_size));
+		}
+
+		gl::uint32 ubo;
+		glGenBuffers(1, &ubo);
+		glBindBuffer(buff_type, ubo);
+
+		const gl::bitfield storage_flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		const GLsizeiptr buffer_size = GLsizeiptr(slice_size * slices);
+		glBufferStorage(buff_type, buffer_size, nullptr, storage_flags);
+		mapped_ptr = (uint8_t*)glMapBufferRange(buff_type, 0, buffer_size, storage_flags);
 		glBindBuffer(buff_type, 0);
 
 		return ubo;
 	}
 
+	// Block until the GPU has consumed the commands guarded by the fence.
+	// Commands are flushed on the first wait only, as required by the spec.
+	void waitFence(gl::sync& fence)
+	{
+		if (fence)
+		{
+			const gl::uint64 timeout_ns = 1000000;
+			gl::bitfield wait_flags = GL_SYNC_FLUSH_COMMANDS_BIT;
+
+			for (;;)
+			{
+				gl::enumerator wait_result = glClientWaitSync(fence, wait_flags, timeout_ns);
+				if (wait_result != GL_TIMEOUT_EXPIRED) {
+					break;
+				}
+
+				wait_flags = 0;
+			}
+
+			glDeleteSync(fence);
+			fence = nullptr;
+		}
+	}
+
 	void updateBuffer(gl::enumerator buff_type, gl::uint32 ubo, uint8_t* buffer, gl::int32 offset, gl::sizei size)
 	{
 		if (size > 0) {
@@ -129,52 +289,324 @@ namespace
 		glDeleteBuffers(1, &vao);
 		vao = 0;
 	}
+
+	// Per instance attribute holding 0, 1, 2, ... which, being an
+	// instanced attribute, is offset by the base instance of the draw.
+	gl::uint32 initDrawIdBuffer(gl::uint32 vao, size_t count)
+	{
+		std::vector<gl::uint32> draw_ids(count);
+		for (size_t di = 0; di < count; ++di) {
+			draw_ids[di] = gl::uint32(di);
+		}
+
+		gl::uint32 vbo;
+		glGenBuffers(1, &vbo);
+		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		glBufferData(GL_ARRAY_BUFFER, count * sizeof(gl::uint32), draw_ids.data(), GL_STATIC_DRAW);
+
+		glBindVertexArray(vao);
+		glEnableVertexAttribArray(0);
+		glVertexAttribIPointer(0, 1, GL_UNSIGNED_INT, sizeof(gl::uint32), gl::bufferOffset(0));
+		glVertexAttribDivisor(0, 1);
+		glBindVertexArray(0);
+
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		return vbo;
+	}
 }
 
 bool SpriteBatch::init(glm::mat4 projection, uint32_t texture_id,
 	const char * vs_source, const char * fs_source,
-	size_t max_templates, size_t max_sprites)
+	size_t max_templates, size_t max_sprites,
+	UploadMode upload_mode, InstanceFormat instance_format,
+	BufferBackend buffer_backend, DrawMode draw_mode)
 {
+	bHeadless = false;
+	mMaxTemplates = max_templates;
+	mMaxInstances = max_sprites;
+
+	// Instances and data are the storage blocks of sprite.vert, plus tweens in compact form
+	mBufferBackend = buffer_backend;
+	if (mBufferBackend == eBB_STORAGE)
+	{
+		const gl::int32 vertex_blocks = (instance_format == eIF_COMPACT) ? 3 : 2;
+		gl::int32 max_vertex_blocks(0);
+		glGetIntegerv(GL_MAX_VERTEX_SHADER_STORAGE_BLOCKS, &max_vertex_blocks);
+		if (max_vertex_blocks < vertex_blocks) {
+			mBufferBackend = eBB_UNIFORM;
+		}
+	}
+
+	const gl::enumerator instance_buffer_type = (mBufferBackend == eBB_STORAGE)
+		? GL_SHADER_STORAGE_BUFFER : GL_UNIFORM_BUFFER;
+
+	mBufferType[eUBO_PROJECTION] = GL_UNIFORM_BUFFER;
+	mBufferType[eUBO_TEMPLATE] = GL_UNIFORM_BUFFER;
+	mBufferType[eUBO_INSTANCE] = instance_buffer_type;
+	mBufferType[eUBO_DATA] = instance_buffer_type;
+	mBufferType[eUBO_TWEEN] = instance_buffer_type;
+
+	// Cached, as growth can be decided away from the context
+	for (size_t ui = 0; ui < eUBO_MAX; ++ui) {
+		mMaxBlockSize[ui] = size_t(getMaxBlockSize(mBufferType[ui]));
+		mBlockAlignment[ui] = alignedBufferSize(mBufferType[ui], 1);
+	}
+
+	mInstanceFormat = instance_format;
+	mDataStride = (mInstanceFormat == eIF_COMPACT) ? sizeof(CompactData) : sizeof(Data);
+	initStreamedBuffers();
+
 	std::array<const char*, GraphicsPipeline::StageType::eST_MAX> filestages = {
 		vs_source, nullptr, nullptr, nullptr, fs_source, nullptr
 	};
 
-	// Build shader program
-	mGraphicsPipe = ShaderCompiler::buildFromFiles(filestages);
+	// Shaders are sized after the batch, and select the instance format
+	const std::string shader_defines = fmt::format(
+		"#define MAX_TEMPLATES {}\n#define MAX_INSTANCES {}\n{}{}{}",
+		mMaxTemplates, mMaxInstances,
+		mInstanceFormat == eIF_COMPACT ? "#define COMPACT_DATA\n" : "",
+		mBufferBackend == eBB_STORAGE ? "#define STORAGE_BUFFERS\n" : "",
+		draw_mode == eDM_MULTI_DRAW_INDIRECT ? "#define MULTI_DRAW\n" : "");
+
+	// Build shader program, the culling passes are built on demand
+	mGraphicsPipe = ShaderCompiler::buildFromFiles(filestages, shader_defines.c_str());
+	mShaderDefines = shader_defines;
 
 	// Create uniform buffers
-	mUBO[eUBO_PROJECTION] = initBuffer(BUFFER_TYPE, sizeof(projection), false);
-	fillBuffer(BUFFER_TYPE, mUBO[eUBO_PROJECTION], (uint8_t*)&projection[0], sizeof(projection));
+	mUBO[eUBO_PROJECTION] = initBuffer(mBufferType[eUBO_PROJECTION], sizeof(projection), false);
+	fillBuffer(mBufferType[eUBO_PROJECTION], mUBO[eUBO_PROJECTION], (uint8_t*)&projection[0], sizeof(projection));
 
-	mMaxTemplates = max_templates;
-	mUBO[eUBO_TEMPLATE] = initBuffer(BUFFER_TYPE, mMaxTemplates * Template::VBO_SIZE, false);
-	
-	mMaxInstances = max_sprites;
-	mUBO[eUBO_INSTANCE] = initBuffer(BUFFER_TYPE, mMaxInstances * sizeof(Instance), true);
-	mUBO[eUBO_DATA] = initBuffer(BUFFER_TYPE, mMaxInstances * sizeof(Data), true);
+	mUBO[eUBO_TEMPLATE] = initBuffer(mBufferType[eUBO_TEMPLATE], mMaxTemplates * Template::VBO_SIZE, false);
+
+	// Persistent mapping requires immutable buffer storage (GL 4.4)
+	mUploadMode = upload_mode;
+	if (mUploadMode == eUM_PERSISTENT_RING && !GLEW_ARB_buffer_storage) {
+		mUploadMode = eUM_MAP_INVALIDATE;
+	}
+
+	mRingIndex = 0;
+	for (size_t fi = 0; fi < RING_FRAMES; ++fi) {
+		mFences[fi] = nullptr;
+	}
+
+	for (size_t ui = 0; ui < eUBO_MAX; ++ui) {
+		mMappedPtr[ui] = nullptr;
+		mSliceSize[ui] = 0;
+	}
+
+	mUBO[eUBO_TWEEN] = 0;
+
+	if (mUploadMode == eUM_PERSISTENT_RING)
+	{
+		mSliceSize[eUBO_INSTANCE] = alignedBufferSize(mBufferType[eUBO_INSTANCE], mMaxInstances * sizeof(Instance));
+		mUBO[eUBO_INSTANCE] = initPersistentBuffer(mBufferType[eUBO_INSTANCE],
+			mSliceSize[eUBO_INSTANCE], RING_FRAMES, mMappedPtr[eUBO_INSTANCE]);
+
+		mSliceSize[eUBO_DATA] = alignedBufferSize(mBufferType[eUBO_DATA], mMaxInstances * mDataStride);
+		mUBO[eUBO_DATA] = initPersistentBuffer(mBufferType[eUBO_DATA],
+			mSliceSize[eUBO_DATA], RING_FRAMES, mMappedPtr[eUBO_DATA]);
+
+		if (mInstanceFormat == eIF_COMPACT)
+		{
+			mSliceSize[eUBO_TWEEN] = alignedBufferSize(mBufferType[eUBO_TWEEN], mMaxInstances * sizeof(TweenData));
+			mUBO[eUBO_TWEEN] = initPersistentBuffer(mBufferType[eUBO_TWEEN],
+				mSliceSize[eUBO_TWEEN], RING_FRAMES, mMappedPtr[eUBO_TWEEN]);
+		}
+	}
+	else
+	{
+		mUBO[eUBO_INSTANCE] = initBuffer(mBufferType[eUBO_INSTANCE], mMaxInstances * sizeof(Instance), true);
+		mUBO[eUBO_DATA] = initBuffer(mBufferType[eUBO_DATA], mMaxInstances * mDataStride, true);
+		if (mInstanceFormat == eIF_COMPACT) {
+			mUBO[eUBO_TWEEN] = initBuffer(mBufferType[eUBO_TWEEN], mMaxInstances * sizeof(TweenData), true);
+		}
+	}
+
+	mDrawMode = draw_mode;
+	initInstances();
 
 	// Create the vertex array for the draw command
 	mVAO = initVAO();
 
-	// Record texture id
+	if (mDrawMode == eDM_MULTI_DRAW_INDIRECT)
+	{
+		mDrawIdBuffer = initDrawIdBuffer(mVAO, mMaxInstances);
+		glGenBuffers(1, &mIndirectBuffer);
+	}
+
+	// Record texture id, texture arrays come with their own parameters
 	mTexId = texture_id;
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, mTexId);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	if (mDrawMode == eDM_INSTANCED)
+	{
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, mTexId);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	}
 
 	return mGraphicsPipe.isValid() && mVAO &&
 		mUBO[eUBO_TEMPLATE] &&	mUBO[eUBO_INSTANCE] &&	mUBO[eUBO_PROJECTION];
 }
 
+bool SpriteBatch::initHeadless(size_t max_templates, size_t max_sprites,
+	InstanceFormat instance_format, DrawMode draw_mode)
+{
+	bHeadless = true;
+	mMaxTemplates = max_templates;
+	mMaxInstances = max_sprites;
+
+	// Nothing bounds the capacity but memory, hence it grows as storage does
+	mBufferBackend = eBB_STORAGE;
+	mUploadMode = eUM_MAP_INVALIDATE;
+	mInstanceFormat = instance_format;
+	mDataStride = (mInstanceFormat == eIF_COMPACT) ? sizeof(CompactData) : sizeof(Data);
+	initStreamedBuffers();
+
+	mTexId = 0;
+	mVAO = 0;
+	mRingIndex = 0;
+	for (size_t fi = 0; fi < RING_FRAMES; ++fi) {
+		mFences[fi] = nullptr;
+	}
+
+	for (size_t ui = 0; ui < eUBO_MAX; ++ui) {
+		mUBO[ui] = 0;
+		mBufferType[ui] = 0;
+		mMappedPtr[ui] = nullptr;
+		mSliceSize[ui] = 0;
+		mMaxBlockSize[ui] = SIZE_MAX;
+		mBlockAlignment[ui] = 1;
+	}
+
+	mDrawMode = draw_mode;
+	initInstances();
+
+	return true;
+}
+
+void SpriteBatch::initStreamedBuffers()
+{
+	// Matrix tweens are evaluated on the CPU, the shader never reads them
+	mStreamedBuffers.assign(std::begin(StreamedBuffers), std::end(StreamedBuffers));
+	if (mInstanceFormat != eIF_COMPACT) {
+		mStreamedBuffers.pop_back();
+	}
+}
+
+void SpriteBatch::initInstances()
+{
+	bDirtyTemplates = false;
+	for (size_t fi = 0; fi < RING_FRAMES; ++fi) {
+		for (size_t ui = 0; ui < eUBO_MAX; ++ui) {
+			mDirtyRanges[fi][ui].reset();
+		}
+	}
+
+	// Reserve everything up front, adding and removing instances
+	// never allocates from here on, unless storage buffers grow.
+	mInstances.reserve(mMaxInstances);
+	mPositions.reserve(mMaxInstances);
+	mScales.reserve(mMaxInstances);
+	mRotations.reserve(mMaxInstances);
+	mColors.reserve(mMaxInstances);
+	mData.reserve(mMaxInstances * mDataStride);
+	mTweens.reserve(mMaxInstances);
+	mTweenData.reserve(mMaxInstances);
+	mStaleRange.reset();
+	mTime = 0.f;
+	mTweensEnd = 0.f;
+	mDrawnTime = 0.f;
+	mDenseToSlot.reserve(mMaxInstances);
+
+	// Chain all the slots into the free list
+	mSlots.resize(mMaxInstances);
+	for (size_t si = 0; si < mMaxInstances; ++si) {
+		mSlots[si].mDense = uint32_t(si + 1 < mMaxInstances ? si + 1 : INDEX_NONE);
+		mSlots[si].mGeneration = 0;
+	}
+
+	mFreeSlot = mMaxInstances ? 0 : uint32_t(INDEX_NONE);
+	mUploadedBytes = 0;
+
+	mRecording = nullptr;
+	bThreaded = false;
+	mDeviceCapacity = mMaxInstances;
+
+	// Layers are known as templates get created
+	mNumLayers = 0;
+	mIndirectBuffer = 0;
+	mDrawIdBuffer = 0;
+	bDirtyDrawList = false;
+
+	mDrawList.reserve(mMaxInstances);
+	mSortKeys.reserve(mMaxInstances);
+	mSortItems.reserve(mMaxInstances);
+	mSortScratch.reserve(mMaxInstances);
+
+	// Everything is drawn until told otherwise
+	mCullMode = eCM_NONE;
+	mViewport = glm::vec4(0.f);
+	bDirtyBounds = false;
+	bDirtyVisibility = false;
+	mGridOrigin = glm::vec2(0.f);
+	mGridCellSize = CULL_CELL_SIZE;
+	mGridWidth = 0;
+	mGridHeight = 0;
+	mVisibleBuffer = 0;
+	mGroupCountBuffer = 0;
+	mIndirectSize = 0;
+
+	mBounds.reserve(mMaxInstances);
+	mVisible.reserve(mMaxInstances);
+	mVisibleList.reserve(mMaxInstances);
+}
+
 void SpriteBatch::release()
 {
+	// Nothing but CPU memory, which goes along with the batch
+	if (bHeadless) {
+		return;
+	}
+
 	mGraphicsPipe.destroy();
+	mCullCountPipe.destroy();
+	mCullCompactPipe.destroy();
+
+	for (size_t fi = 0; fi < RING_FRAMES; ++fi) {
+		if (mFences[fi]) {
+			glDeleteSync(mFences[fi]);
+			mFences[fi] = nullptr;
+		}
+	}
 
 	for (size_t ui = 0; ui < eUBO_MAX; ++ui) {
-		releaseBuffer(mUBO[ui]);
+		if (mMappedPtr[ui]) {
+			glBindBuffer(mBufferType[ui], mUBO[ui]);
+			glUnmapBuffer(mBufferType[ui]);
+			mMappedPtr[ui] = nullptr;
+		}
+
+		if (mUBO[ui]) {
+			releaseBuffer(mUBO[ui]);
+		}
+	}
+
+	if (mIndirectBuffer) {
+		releaseBuffer(mIndirectBuffer);
+	}
+
+	if (mDrawIdBuffer) {
+		releaseBuffer(mDrawIdBuffer);
+	}
+
+	if (mVisibleBuffer) {
+		releaseBuffer(mVisibleBuffer);
+	}
+
+	if (mGroupCountBuffer) {
+		releaseBuffer(mGroupCountBuffer);
 	}
 
 	releaseVAO(mVAO);
@@ -198,281 +630,1408 @@ void SpriteBatch::fillTemplatesBuffer()
 			mTemplates[i].mVBO, Template::VBO_SIZE);
 	}
 
-	fillBuffer(BUFFER_TYPE, mUBO[eUBO_TEMPLATE], templates_buffer.get(), buffer_size);
+	uploadRange(eUBO_TEMPLATE, 0, 0, templates_buffer.get(), buffer_size);
+
+	mUploadedBytes += buffer_size;
 	bDirtyTemplates = false;
 }
 
-void SpriteBatch::fillInstancesBuffer()
+void SpriteBatch::markDirty(Uniform buffer, size_t first, size_t count)
 {
-	// Refill the whole buffer with new data
-	if (!bDirtyInstances) {
+	// The draw list gets sorted, and uploaded, as a whole
+	if (buffer == eUBO_INSTANCE) {
+		bDirtyDrawList = true;
 		return;
 	}
 
-	// Update instances buffer
-	{
-		const size_t elem_size = sizeof(Instance);
-		const size_t n_instances = mInstances.size();
-		const size_t instance_buffer_size = n_instances * elem_size;
-		std::unique_ptr<uint8_t> instance_buffer(new uint8_t[instance_buffer_size]);
-
-		for (size_t i = 0; i < n_instances; ++i)
-		{
-			const size_t offset = i * elem_size;
-			memcpy(instance_buffer.get() + offset, mInstances[i].get(), elem_size);
-		}
+	// Data and tweens move the bounds the instances are culled by
+	bDirtyBounds = true;
 
-		fillBuffer(BUFFER_TYPE, mUBO[eUBO_INSTANCE], instance_buffer.get(), instance_buffer_size);
+	if (buffer == eUBO_TWEEN && mInstanceFormat != eIF_COMPACT) {
+		return;
 	}
 
-	// Update transform buffer
-	{
-		const size_t elem_size = sizeof(Data);
-		const size_t n_transform = mData.size();
-		const size_t transform_buffer_size = n_transform * elem_size;
-		std::unique_ptr<uint8_t> transform_buffer(new uint8_t[transform_buffer_size]);
-
-		for (size_t i = 0; i < n_transform; ++i)
-		{
-			const size_t offset = i * elem_size;
-			memcpy(transform_buffer.get() + offset, &mData[i], elem_size);
-		}
-
-		fillBuffer(BUFFER_TYPE, mUBO[eUBO_DATA], transform_buffer.get(), transform_buffer_size);
+	for (size_t fi = 0; fi < RING_FRAMES; ++fi) {
+		mDirtyRanges[fi][buffer].add(first, count);
 	}
-
-	bDirtyInstances = false;
 }
 
-void SpriteBatch::flushBuffers()
+uint64_t SpriteBatch::makeSortKey(uint32_t layer, uint16_t depth, uint32_t template_id, uint32_t slot_id)
 {
-	// Update pending templates
-	fillTemplatesBuffer();
-
-	// Update pending instance transformations
-	fillInstancesBuffer();
+	assert(layer < (1u << 8) && template_id < (1u << 16) && slot_id < (1u << 24));
+	return (uint64_t(layer) << 56) | (uint64_t(depth) << 40)
+		| (uint64_t(template_id) << 24) | uint64_t(slot_id);
 }
 
-void SpriteBatch::draw() const
+void SpriteBatch::buildDrawList()
 {
-	// bind shader programs
-	glBindProgramPipeline(mGraphicsPipe.getPipeId());
-
-	// bind buffers
-	for (gl::uint32 ui = 0; ui < eUBO_MAX; ++ui) {
-		glBindBufferBase(BUFFER_TYPE, ui, mUBO[ui]);
+	const size_t n_instances = mInstances.size();
+
+	// Both buffers are reserved at capacity, hence this doesn't allocate
+	mSortItems.resize(n_instances);
+	mSortScratch.resize(n_instances);
+	for (size_t i = 0; i < n_instances; ++i) {
+		mSortItems[i].mKey = mSortKeys[i];
+		mSortItems[i].mDenseId = uint32_t(i);
 	}
 
-	// bind texture
-	glBindTextures(0, 1, &mTexId);
+	SortItem* sorted = mSortItems.data();
+	SortItem* scratch = mSortScratch.data();
+	radixSort(sorted, scratch, n_instances);
 
-	// bind the vertex array buffer, which is required
-	glBindVertexArray(mVAO);
+	mDrawList.resize(n_instances);
+	for (size_t i = 0; i < n_instances; ++i) {
+		mDrawList[i] = mInstances[sorted[i].mDenseId];
+	}
 
-	// buffer vertex count
-	glDrawArraysInstanced(GL_TRIANGLES, 0, MAX_VERTICES, mData.size());
-}
+	bDirtyDrawList = false;
+	bDirtyVisibility = true;
 
-SpriteBatch::Template SpriteBatch::Template::INVALID = {
-	nullptr, INDEX_NONE
-};
+	// Culling on the CPU uploads, and draws, the list it compacts
+	if (mCullMode == eCM_CPU) {
+		return;
+	}
 
-SpriteBatch::Instance SpriteBatch::Instance::INVALID = {
-	INDEX_NONE, INDEX_NONE
-};
+	// Every slice misses the new list
+	for (size_t fi = 0; fi < RING_FRAMES; ++fi) {
+		mDirtyRanges[fi][eUBO_INSTANCE].add(0, n_instances);
+	}
 
+	// Culling on the GPU writes the commands itself
+	if (mCullMode == eCM_NONE) {
+		buildDrawCommands(mDrawList);
+	}
+}
 
-glm::vec2 SpriteBatch::getInstancePosition(const std::shared_ptr<Instance>& instance) const
+void SpriteBatch::buildDrawCommands(const std::vector<Instance>& draw_list)
 {
-	assert(instance->isValid());
-	glm::mat4 transformation = mData[instance->mDataId].mTransform;
+	if (mDrawMode != eDM_MULTI_DRAW_INDIRECT) {
+		return;
+	}
+
+	// Layers are the most significant part of the key, hence contiguous
+	mDrawCommands.assign(mNumLayers, DrawCommand{ uint32_t(MAX_VERTICES), 0, 0, 0 });
+	for (const Instance& instance : draw_list) {
+		assert(instance.mLayer < mNumLayers);
+		++mDrawCommands[instance.mLayer].mInstanceCount;
+	}
 
-	glm::vec3 scale;
-	glm::quat rotation;
-	glm::vec3 translation;
-	glm::vec3 skew;
-	glm::vec4 perspective;
-	glm::decompose(transformation, scale, rotation, translation, skew, perspective);
+	uint32_t base_instance = 0;
+	for (DrawCommand& command : mDrawCommands) {
+		command.mBaseInstance = base_instance;
+		base_instance += command.mInstanceCount;
+	}
+
+	if (mRecording) {
+		mRecording->mCommands = mDrawCommands;
+		mRecording->bNewCommands = true;
+	}
+	else if (!bHeadless) {
+		uploadDrawCommands(mDrawCommands);
+	}
 
-	return glm::vec2(translation);
+	mUploadedBytes += mDrawCommands.size() * sizeof(DrawCommand);
 }
 
-glm::vec2 SpriteBatch::getInstanceSize(const std::shared_ptr<Instance>& instance) const
+void SpriteBatch::uploadDrawCommands(const std::vector<DrawCommand>& commands)
 {
-	assert(instance->isValid());
-	glm::mat4 transformation = mData[instance->mDataId].mTransform;
+	const size_t commands_size = commands.size() * sizeof(DrawCommand);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, mIndirectBuffer);
+	glBufferData(GL_DRAW_INDIRECT_BUFFER, commands_size, commands.data(), GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
 
-	glm::vec3 scale;
-	glm::quat rotation;
-	glm::vec3 translation;
-	glm::vec3 skew;
-	glm::vec4 perspective;
-	glm::decompose(transformation, scale, rotation, translation, skew, perspective);
-
-	return glm::vec2(scale);
+	mIndirectSize = commands_size;
 }
 
-float SpriteBatch::getInstanceRotation(const std::shared_ptr<Instance>& instance) const
+bool SpriteBatch::setCullMode(CullMode cull_mode, const char* cs_source)
 {
-	assert(instance->isValid());
-	glm::mat4 transformation = mData[instance->mDataId].mTransform;
+	// The compute passes decode compact records out of storage blocks
+	CullMode new_mode = cull_mode;
+	if (new_mode == eCM_GPU && (mInstanceFormat != eIF_COMPACT
+		|| mBufferBackend != eBB_STORAGE || !cs_source || bHeadless)) {
+		new_mode = eCM_CPU;
+	}
+
+	if (new_mode == eCM_GPU && !mCullCompactPipe.isValid())
+	{
+		std::array<const char*, GraphicsPipeline::StageType::eST_MAX> filestages = {
+			nullptr, nullptr, nullptr, nullptr, nullptr, cs_source
+		};
+
+		// Both passes live in the same source
+		const std::string count_defines = mShaderDefines + "#define CULL_COUNT\n";
+		mCullCountPipe = ShaderCompiler::buildFromFiles(filestages, count_defines.c_str());
+		mCullCompactPipe = ShaderCompiler::buildFromFiles(filestages, mShaderDefines.c_str());
+
+		allocateCullBuffers(mMaxInstances);
+		if (!mIndirectBuffer) {
+			glGenBuffers(1, &mIndirectBuffer);
+		}
+	}
 
-	glm::vec3 scale;
-	glm::quat rotation;
-	glm::vec3 translation;
-	glm::vec3 skew;
-	glm::vec4 perspective;
-	glm::decompose(transformation, scale, rotation, translation, skew, perspective);
+	// Upload, and draw, what the new mode expects
+	mCullMode = new_mode;
+	bDirtyDrawList = true;
+	bDirtyBounds = true;
 
-	return glm::angle(rotation);
+	return mCullMode == cull_mode;
 }
 
-glm::vec4 SpriteBatch::getInstanceColor(const std::shared_ptr<Instance>& instance) const
+void SpriteBatch::setViewport(glm::vec4 viewport)
 {
-	assert(instance->isValid());
-	return mData[instance->mDataId].mColor;
+	if (viewport != mViewport) {
+		mViewport = viewport;
+		bDirtyVisibility = true;
+	}
 }
 
-const SpriteBatch::Template& SpriteBatch::getInstanceTemplate(const std::shared_ptr<Instance>& instance) const
+size_t SpriteBatch::getVisibleCount() const
 {
-	assert(instance->isValid());
-	return mTemplates[instance->mTemplateId];
+	return (mCullMode == eCM_CPU) ? mVisibleList.size() : mInstances.size();
 }
 
-const SpriteBatch::Template& SpriteBatch::createTemplate(glm::vec4 atlas_offsets)
+void SpriteBatch::computeBounds()
 {
-	float left = atlas_offsets.x;
-	float top = atlas_offsets.y;
-	float right = atlas_offsets.z;
-	float bottom = atlas_offsets.w;
-
-	// Interleaved array of vertex
-	// positions and texture coordinates
-	const glm::vec4 vbo[MAX_VERTICES] = {
-		glm::vec4(0.0f, 1.0f, left, top),
-		glm::vec4(1.0f, 0.0f, right, bottom),
-		glm::vec4(0.0f, 0.0f, left, bottom),
-
-		glm::vec4(0.0f, 1.0f, left, top),
-		glm::vec4(1.0f, 1.0f, right, top),
-		glm::vec4(1.0f, 0.0f, right, bottom)
-	};
+	const size_t n_instances = mInstances.size();
+	mBounds.resize(n_instances);
 
-	// we can't add more than the maximum templates
-	if (mTemplates.size() < mMaxTemplates)
+	for (size_t i = 0; i < n_instances; ++i)
 	{
-		Template new_template(vbo, mTemplates.size());
-		mTemplates.push_back(new_template);
+		// Sprites rotate around their centre, the circle
+		// through the corners holds them at any angle
+		glm::vec2 centre = mPositions[i] + 0.5f * mScales[i];
+		float radius = 0.5f * glm::length(mScales[i]);
+		glm::vec4 bounds(centre - radius, centre + radius);
+
+		// Anything in between the ends of a tween lies within both
+		const Tween& tween = mTweens[i];
+		if (tween.mDuration > 0.f)
+		{
+			centre = tween.mPosition + 0.5f * tween.mScale;
+			radius = 0.5f * glm::length(tween.mScale);
+			bounds = glm::vec4(
+				glm::min(glm::vec2(bounds.x, bounds.y), centre - radius),
+				glm::max(glm::vec2(bounds.z, bounds.w), centre + radius));
+		}
 
-		bDirtyTemplates = true;
-		return mTemplates.back();
+		mBounds[i] = bounds;
 	}
-
-	return SpriteBatch::Template::INVALID;
 }
 
-bool SpriteBatch::swapInstanceTemplate(std::shared_ptr<Instance>& instance, const Template & new_template)
+void SpriteBatch::buildCullGrid()
 {
-	if (new_template.isValid() && instance->isValid())
-	{
-		assert(new_template.mTemplateId < mTemplates.size());
-		instance->mTemplateId = new_template.mTemplateId;
+	const size_t n_instances = mBounds.size();
 
-		bDirtyInstances = true;
-		return true;
+	mGridWidth = 0;
+	mGridHeight = 0;
+	mGridOffsets.assign(1, 0);
+
+	if (n_instances == 0) {
+		return;
 	}
 
-	return false;
-}
+	glm::vec2 lower(mBounds[0].x, mBounds[0].y);
+	glm::vec2 upper(mBounds[0].z, mBounds[0].w);
+	for (const glm::vec4& bounds : mBounds) {
+		lower = glm::min(lower, glm::vec2(bounds.x, bounds.y));
+		upper = glm::max(upper, glm::vec2(bounds.z, bounds.w));
+	}
 
-std::shared_ptr<SpriteBatch::Instance> SpriteBatch::addInstance(const Template& template_ref)
-{
-	if (template_ref.isValid())
+	const glm::vec2 extent = upper - lower;
+	mGridOrigin = lower;
+	mGridCellSize = std::max(CULL_CELL_SIZE, std::max(extent.x, extent.y) / float(MAX_CULL_GRID_DIM));
+	mGridWidth = std::min(MAX_CULL_GRID_DIM, uint32_t(extent.x / mGridCellSize) + 1);
+	mGridHeight = std::min(MAX_CULL_GRID_DIM, uint32_t(extent.y / mGridCellSize) + 1);
+
+	// Count the entries of each cell, an instance lands in every cell it overlaps
+	const size_t n_cells = size_t(mGridWidth) * size_t(mGridHeight);
+	mGridOffsets.assign(n_cells + 1, 0);
+
+	uint32_t x0, x1, y0, y1;
+	for (const glm::vec4& bounds : mBounds)
 	{
-		// find the template associated with this instance
-		auto sprite_template = std::find_if(mTemplates.begin(), mTemplates.end(),
-			[&template_ref](const Template& t) {
-			return t.mTemplateId == template_ref.mTemplateId;
-		});
+		cellSpan(bounds.x, bounds.z, mGridOrigin.x, mGridCellSize, mGridWidth, x0, x1);
+		cellSpan(bounds.y, bounds.w, mGridOrigin.y, mGridCellSize, mGridHeight, y0, y1);
+		for (uint32_t cy = y0; cy <= y1; ++cy) {
+			for (uint32_t cx = x0; cx <= x1; ++cx) {
+				++mGridOffsets[size_t(cy) * mGridWidth + cx];
+			}
+		}
+	}
+
+	// Where each cell ends, cells are filled from their end backwards,
+	// which leaves each offset to where its cell starts.
+	for (size_t ci = 1; ci < n_cells; ++ci) {
+		mGridOffsets[ci] += mGridOffsets[ci - 1];
+	}
 
-		// if found the template
-		if (sprite_template != std::end(mTemplates))
+	const size_t n_entries = mGridOffsets[n_cells - 1];
+	mGridOffsets[n_cells] = uint32_t(n_entries);
+
+	mGridIds.resize(n_entries);
+	mGridMinX.resize(n_entries);
+	mGridMinY.resize(n_entries);
+	mGridMaxX.resize(n_entries);
+	mGridMaxY.resize(n_entries);
+
+	for (size_t i = 0; i < n_instances; ++i)
+	{
+		const glm::vec4& bounds = mBounds[i];
+		cellSpan(bounds.x, bounds.z, mGridOrigin.x, mGridCellSize, mGridWidth, x0, x1);
+		cellSpan(bounds.y, bounds.w, mGridOrigin.y, mGridCellSize, mGridHeight, y0, y1);
+		for (uint32_t cy = y0; cy <= y1; ++cy)
 		{
-			// we can't add more than the maximum instances
-			if (mData.size() < mMaxInstances)
+			for (uint32_t cx = x0; cx <= x1; ++cx)
 			{
-				mInstances.push_back(std::make_shared<Instance>(template_ref.mTemplateId, mData.size()));
-				mData.push_back({ glm::mat4(0.0f), glm::vec4(1.0f) });
-
-				bDirtyInstances = true;
-				return mInstances.back();
+				const size_t ei = --mGridOffsets[size_t(cy) * mGridWidth + cx];
+				mGridIds[ei] = uint32_t(i);
+				mGridMinX[ei] = bounds.x;
+				mGridMinY[ei] = bounds.y;
+				mGridMaxX[ei] = bounds.z;
+				mGridMaxY[ei] = bounds.w;
 			}
 		}
 	}
-
-	// return an invalid object
-	return std::make_shared<Instance>(SpriteBatch::Instance::INVALID);
 }
 
-bool SpriteBatch::updateInstance(const std::shared_ptr<Instance>& instance_ref,
-	glm::vec2 position, glm::vec2 scale, glm::vec4 color, float rotation)
+void SpriteBatch::cullInstances()
 {
-	Instance* instance_ptr = instance_ref.get();
-	const auto data_id = instance_ptr->mDataId;
-	if (instance_ptr->isValid() && mData.size() > data_id)
+	if (bDirtyBounds)
 	{
-		glm::mat4 model;
+		computeBounds();
+		buildCullGrid();
+		bDirtyBounds = false;
+		bDirtyVisibility = true;
+	}
 
-		// rotate around the centre
-		model = glm::translate(model, glm::vec3(position, 0.0f));
-		model = glm::translate(model, glm::vec3(0.5f * scale.x, 0.5f * scale.y, 0.0f));
-		model = glm::rotate(model, rotation, glm::vec3(0.0f, 0.0f, 1.0f));
-		model = glm::translate(model, glm::vec3(-0.5f * scale.x, -0.5f * scale.y, 0.0f));
-		model = glm::scale(model, glm::vec3(scale, 1.0f));
+	if (!bDirtyVisibility) {
+		return;
+	}
+
+	// Instances overlapping several cells get flagged more than once
+	mVisible.assign(mInstances.size(), 0);
+
+	if (mGridWidth && mGridHeight)
+	{
+		uint32_t x0, x1, y0, y1;
+		cellSpan(mViewport.x, mViewport.z, mGridOrigin.x, mGridCellSize, mGridWidth, x0, x1);
+		cellSpan(mViewport.y, mViewport.w, mGridOrigin.y, mGridCellSize, mGridHeight, y0, y1);
+
+		const __m128 view_left = _mm_set1_ps(mViewport.x);
+		const __m128 view_bottom = _mm_set1_ps(mViewport.y);
+		const __m128 view_right = _mm_set1_ps(mViewport.z);
+		const __m128 view_top = _mm_set1_ps(mViewport.w);
+
+		for (uint32_t cy = y0; cy <= y1; ++cy)
+		{
+			for (uint32_t cx = x0; cx <= x1; ++cx)
+			{
+				const size_t cell = size_t(cy) * mGridWidth + cx;
+				const size_t entries_end = mGridOffsets[cell + 1];
+				size_t ei = mGridOffsets[cell];
+
+				// Four entries at a time, the cell tail one by one
+				for (; ei + 4 <= entries_end; ei += 4)
+				{
+					const __m128 overlap_x = _mm_and_ps(
+						_mm_cmple_ps(_mm_loadu_ps(&mGridMinX[ei]), view_right),
+						_mm_cmpge_ps(_mm_loadu_ps(&mGridMaxX[ei]), view_left));
+					const __m128 overlap_y = _mm_and_ps(
+						_mm_cmple_ps(_mm_loadu_ps(&mGridMinY[ei]), view_top),
+						_mm_cmpge_ps(_mm_loadu_ps(&mGridMaxY[ei]), view_bottom));
+
+					const int mask = _mm_movemask_ps(_mm_and_ps(overlap_x, overlap_y));
+					for (size_t li = 0; li < 4; ++li) {
+						if (mask & (1 << li)) {
+							mVisible[mGridIds[ei + li]] = 1;
+						}
+					}
+				}
+
+				for (; ei < entries_end; ++ei)
+				{
+					const glm::vec4 bounds(mGridMinX[ei], mGridMinY[ei], mGridMaxX[ei], mGridMaxY[ei]);
+					if (overlaps(bounds, mViewport)) {
+						mVisible[mGridIds[ei]] = 1;
+					}
+				}
+			}
+		}
+	}
+
+	// Keep the draw list order, hence layers stay contiguous
+	mVisibleList.clear();
+	for (const Instance& instance : mDrawList) {
+		assert(instance.mDataId < mVisible.size());
+		if (mVisible[instance.mDataId]) {
+			mVisibleList.push_back(instance);
+		}
+	}
+
+	for (size_t fi = 0; fi < RING_FRAMES; ++fi) {
+		mDirtyRanges[fi][eUBO_INSTANCE].add(0, mVisibleList.size());
+	}
+
+	buildDrawCommands(mVisibleList);
+	bDirtyVisibility = false;
+}
+
+void SpriteBatch::allocateCullBuffers(size_t capacity)
+{
+	if (mVisibleBuffer) {
+		releaseBuffer(mVisibleBuffer);
+	}
+
+	if (mGroupCountBuffer) {
+		releaseBuffer(mGroupCountBuffer);
+	}
+
+	// Both are written by the passes, nothing to carry over
+	const size_t n_groups = (capacity + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE;
+	mVisibleBuffer = initBuffer(GL_SHADER_STORAGE_BUFFER,
+		std::max<size_t>(capacity, 1) * sizeof(Instance), true);
+	mGroupCountBuffer = initBuffer(GL_SHADER_STORAGE_BUFFER,
+		std::max<size_t>(n_groups, 1) * sizeof(uint32_t), true);
+}
+
+void SpriteBatch::dispatchCulling(const FrameState& state)
+{
+	// One command per layer, or a single one for the instanced draw
+	const size_t n_instances = state.mCullCount;
+	const size_t n_commands = (mDrawMode == eDM_MULTI_DRAW_INDIRECT) ? state.mLayerCount : 1;
+	const size_t n_groups = std::max<size_t>((n_instances + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE, 1);
+
+	const size_t commands_size = std::max<size_t>(n_commands, 1) * sizeof(DrawCommand);
+	if (mIndirectSize < commands_size)
+	{
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, mIndirectBuffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, commands_size, nullptr, GL_DYNAMIC_DRAW);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+		mIndirectSize = commands_size;
+	}
+
+	// The passes read the same slices the draw does
+	bindInstanceBuffers(state.mRingIndex);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, VISIBLE_BINDING, mVisibleBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, GROUPS_BINDING, mGroupCountBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, COMMANDS_BINDING, mIndirectBuffer);
+
+	for (const GraphicsPipeline* pipe : { &mCullCountPipe, &mCullCompactPipe })
+	{
+		const gl::uint32 prog_id = pipe->getPorgId();
+		glProgramUniform1f(prog_id, TIME_UNIFORM_LOCATION, state.mTime);
+		glProgramUniform4f(prog_id, VIEWPORT_UNIFORM_LOCATION,
+			state.mViewport.x, state.mViewport.y, state.mViewport.z, state.mViewport.w);
+		glProgramUniform1ui(prog_id, COUNT_UNIFORM_LOCATION, gl::uint32(n_instances));
+		glProgramUniform1ui(prog_id, LAYERS_UNIFORM_LOCATION, gl::uint32(n_commands));
+	}
+
+	// Count the visible instances of each group, and reset the commands
+	glBindProgramPipeline(mCullCountPipe.getPipeId());
+	glDispatchCompute(gl::uint32(n_groups), 1, 1);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+	// Compact them in draw list order, and count them per command
+	glBindProgramPipeline(mCullCompactPipe.getPipeId());
+	glDispatchCompute(gl::uint32(n_groups), 1, 1);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+}
+
+void SpriteBatch::fillInstancesBuffer()
+{
+	// Upload only the range of instances touched since last flush
+	for (const Uniform ui : mStreamedBuffers)
+	{
+		DirtyRange& range = mDirtyRanges[mRingIndex][ui];
+
+		size_t elem_size(0), elem_count(0);
+		const uint8_t* source = getBufferSource(ui, elem_size, elem_count);
+		const size_t range_end = std::min(range.mEnd, elem_count);
+
+		if (range.mBegin < range_end)
+		{
+			const size_t range_size = (range_end - range.mBegin) * elem_size;
+			uploadRange(ui, mRingIndex, range.mBegin * elem_size, source + range.mBegin * elem_size, range_size);
+
+			mUploadedBytes += range_size;
+		}
+
+		range.reset();
+	}
+}
+
+void SpriteBatch::fillInstancesRing()
+{
+	// Anything changed since the current slice has been written?
+	bool any_dirty = false;
+	for (const Uniform ui : mStreamedBuffers) {
+		any_dirty |= !mDirtyRanges[mRingIndex][ui].isEmpty();
+	}
+
+	if (!any_dirty) {
+		return;
+	}
+
+	// Move onto the next slice, the GPU might still be reading it
+	// from RING_FRAMES draws ago, in which case we have to wait.
+	// A packet leaves the wait to the thread that submits it.
+	mRingIndex = (mRingIndex + 1) % RING_FRAMES;
+	if (mRecording) {
+		mRecording->bWriteSlice = true;
+	}
+	else {
+		waitFence(mFences[mRingIndex]);
+	}
+
+	// Write straight into the mapped slices, no staging copy or map call
+	// is required, and the buffers are coherent, hence no flush either.
+	// The slice only misses the changes happened since it was last written.
+	for (const Uniform ui : mStreamedBuffers)
+	{
+		DirtyRange& range = mDirtyRanges[mRingIndex][ui];
+
+		size_t elem_size(0), elem_count(0);
+		const uint8_t* source = getBufferSource(ui, elem_size, elem_count);
+		const size_t range_end = std::min(range.mEnd, elem_count);
+
+		if (range.mBegin < range_end)
+		{
+			const size_t range_size = (range_end - range.mBegin) * elem_size;
+			uploadRange(ui, mRingIndex, range.mBegin * elem_size, source + range.mBegin * elem_size, range_size);
+
+			mUploadedBytes += range_size;
+		}
+
+		range.reset();
+	}
+}
+
+bool SpriteBatch::fitsDeviceCapacity(size_t capacity) const
+{
+	for (const Uniform ui : mStreamedBuffers) {
+		if (nextMultipleOf(capacity * getElementSize(ui), mBlockAlignment[ui]) > mMaxBlockSize[ui]) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool SpriteBatch::growDeviceBuffers(size_t new_capacity, size_t used_count)
+{
+	const bool persistent = mUploadMode == eUM_PERSISTENT_RING;
+
+	// Make sure all the buffers fit before touching anything
+	if (!fitsDeviceCapacity(new_capacity)) {
+		return false;
+	}
+
+	// Copy on the GPU whatever has been uploaded so far, so that nothing
+	// has to be streamed again. Instances beyond the used count are
+	// dead, hence there is no need to carry them over.
+	for (const Uniform ui : mStreamedBuffers)
+	{
+		const size_t elem_size = getElementSize(ui);
+		const gl::enumerator buff_type = mBufferType[ui];
+		const size_t used_size = used_count * elem_size;
+
+		gl::uint32 new_buffer(0);
+		uint8_t* new_mapped_ptr(nullptr);
+		size_t new_slice_size(0);
+
+		if (persistent)
+		{
+			new_slice_size = alignedBufferSize(buff_type, new_capacity * elem_size);
+			new_buffer = initPersistentBuffer(buff_type, new_slice_size, RING_FRAMES, new_mapped_ptr);
+		}
+		else
+		{
+			new_buffer = initBuffer(buff_type, new_capacity * elem_size, true);
+		}
+
+		glBindBuffer(GL_COPY_READ_BUFFER, mUBO[ui]);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, new_buffer);
+
+		if (used_size)
+		{
+			// Each ring slice keeps its own content, as they are
+			// not necessarily up to date with one another.
+			const size_t slices = persistent ? RING_FRAMES : 1;
+			for (size_t fi = 0; fi < slices; ++fi) {
+				glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER,
+					GLintptr(fi * mSliceSize[ui]), GLintptr(fi * new_slice_size),
+					GLsizeiptr(used_size));
+			}
+		}
+
+		if (mMappedPtr[ui]) {
+			glUnmapBuffer(GL_COPY_READ_BUFFER);
+		}
+
+		glBindBuffer(GL_COPY_READ_BUFFER, 0);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+		// Deletion is deferred by the driver until pending draws are done
+		releaseBuffer(mUBO[ui]);
+
+		mUBO[ui] = new_buffer;
+		mMappedPtr[ui] = new_mapped_ptr;
+		mSliceSize[ui] = new_slice_size;
+	}
+
+	// The slices of the new buffers can't be written by the CPU until the
+	// copies into them are done, hence the fences are all replaced.
+	if (persistent)
+	{
+		for (size_t fi = 0; fi < RING_FRAMES; ++fi)
+		{
+			if (mFences[fi]) {
+				glDeleteSync(mFences[fi]);
+			}
+
+			mFences[fi] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		}
+	}
 
-		mData[data_id].mTransform = model;
-		mData[data_id].mColor = color;
+	// The draw ids have to cover the whole batch
+	if (mDrawMode == eDM_MULTI_DRAW_INDIRECT)
+	{
+		releaseBuffer(mDrawIdBuffer);
+		mDrawIdBuffer = initDrawIdBuffer(mVAO, new_capacity);
+	}
+
+	if (mCullMode == eCM_GPU) {
+		allocateCullBuffers(new_capacity);
+	}
+
+	mDeviceCapacity = new_capacity;
+	return true;
+}
+
+void SpriteBatch::reserveDeviceCapacity(size_t capacity)
+{
+	if (capacity <= mDeviceCapacity || bHeadless) {
+		return;
+	}
+
+	// Whatever the slices held is streamed again, see growInstanceBuffers()
+	if (!growDeviceBuffers(capacity, 0)) {
+		throw std::runtime_error(fmt::format(
+			"Cannot grow the sprite batch buffers to {} instances\n", capacity));
+	}
+}
+
+bool SpriteBatch::growInstanceBuffers(size_t new_capacity)
+{
+	assert(mBufferBackend == eBB_STORAGE);
+
+	// Past the slots the sort keys can tell apart, addInstance() fails instead
+	new_capacity = std::min(new_capacity, size_t(MAX_SLOTS));
+	if (new_capacity <= mMaxInstances) {
+		return false;
+	}
+
+	// The device buffers are only grown by the thread owning the context,
+	// once the next packet gets there. Their content is not carried over,
+	// instead every slice is streamed again from scratch.
+	if (bThreaded)
+	{
+		if (!fitsDeviceCapacity(new_capacity)) {
+			return false;
+		}
+
+		for (size_t fi = 0; fi < RING_FRAMES; ++fi) {
+			for (const Uniform ui : mStreamedBuffers) {
+				mDirtyRanges[fi][ui].add(0, new_capacity);
+			}
+		}
+	}
+	else if (!bHeadless && !growDeviceBuffers(new_capacity, mInstances.size())) {
+		return false;
+	}
+
+	mDrawList.reserve(new_capacity);
+	mSortKeys.reserve(new_capacity);
+	mSortItems.reserve(new_capacity);
+	mSortScratch.reserve(new_capacity);
+
+	mBounds.reserve(new_capacity);
+	mVisible.reserve(new_capacity);
+	mVisibleList.reserve(new_capacity);
+
+	// Grow the CPU side as well, and chain the new slots into the free list
+	mInstances.reserve(new_capacity);
+	mPositions.reserve(new_capacity);
+	mScales.reserve(new_capacity);
+	mRotations.reserve(new_capacity);
+	mColors.reserve(new_capacity);
+	mData.reserve(new_capacity * mDataStride);
+	mTweens.reserve(new_capacity);
+	mTweenData.reserve(new_capacity);
+	mDenseToSlot.reserve(new_capacity);
+
+	mSlots.resize(new_capacity);
+	for (size_t si = mMaxInstances; si < new_capacity; ++si) {
+		mSlots[si].mDense = uint32_t(si + 1 < new_capacity ? si + 1 : mFreeSlot);
+		mSlots[si].mGeneration = 0;
+	}
+
+	mFreeSlot = uint32_t(mMaxInstances);
+	mMaxInstances = new_capacity;
+
+	return true;
+}
+
+void SpriteBatch::flushBuffers()
+{
+	PROFILE_SCOPE("SpriteBatch::flushBuffers");
+	mUploadedBytes = 0;
+
+	// Update pending templates
+	fillTemplatesBuffer();
+
+	// Tweens the vertex shader can't evaluate
+	if (mInstanceFormat == eIF_MATRIX) {
+		advanceTweens();
+	}
+
+	// Bring the GPU records of the changed instances up to date
+	encodeStaleData();
+
+	// Instances have been added, removed or their keys changed
+	if (bDirtyDrawList) {
+		buildDrawList();
+	}
+
+	// Compact the draw list down to what the viewport overlaps
+	if (mCullMode == eCM_CPU) {
+		cullInstances();
+	}
+
+	// Update pending instance transformations
+	if (mUploadMode == eUM_PERSISTENT_RING) {
+		fillInstancesRing();
+	}
+	else {
+		fillInstancesBuffer();
+	}
+}
+
+void SpriteBatch::setThreaded(bool threaded)
+{
+	// Back on the context thread, catch up with the batch capacity
+	if (bThreaded && !threaded) {
+		reserveDeviceCapacity(mMaxInstances);
+	}
+
+	bThreaded = threaded;
+}
 
-		bDirtyInstances = true;
+void SpriteBatch::buildFramePacket(FramePacket& packet)
+{
+	packet.clear();
+
+	mRecording = &packet;
+	flushBuffers();
+	mRecording = nullptr;
+
+	packet.mState = captureFrameState();
+	packet.mCapacity = mMaxInstances;
+	mDrawnTime = mTime;
+}
+
+void SpriteBatch::submitFramePacket(const FramePacket& packet)
+{
+	PROFILE_SCOPE("SpriteBatch::submitFramePacket");
+	reserveDeviceCapacity(packet.mCapacity);
+
+	// The slice is free once the draw that last read it is done
+	if (packet.bWriteSlice) {
+		waitFence(mFences[packet.mState.mRingIndex]);
+	}
+
+	for (const FramePacket::Upload& upload : packet.mUploads) {
+		writeRange(upload.mBuffer, packet.mState.mRingIndex, upload.mOffset,
+			packet.mBytes.data() + upload.mSource, upload.mSize);
+	}
+
+	if (packet.bNewCommands) {
+		uploadDrawCommands(packet.mCommands);
+	}
+
+	drawFrame(packet.mState);
+}
+
+void SpriteBatch::uploadRange(Uniform buffer, size_t ring_index, size_t offset, const uint8_t* source, size_t size)
+{
+	if (mRecording) {
+		mRecording->record(buffer, offset, source, size);
+	}
+	else if (!bHeadless) {
+		writeRange(buffer, ring_index, offset, source, size);
+	}
+}
+
+void SpriteBatch::writeRange(Uniform buffer, size_t ring_index, size_t offset, const uint8_t* source, size_t size)
+{
+	uint8_t* data = const_cast<uint8_t*>(source);
+
+	if (buffer == eUBO_TEMPLATE) {
+		fillBuffer(mBufferType[buffer], mUBO[buffer], data, size);
+	}
+	else if (mMappedPtr[buffer]) {
+		memcpy(mMappedPtr[buffer] + ring_index * mSliceSize[buffer] + offset, source, size);
+	}
+	else {
+		updateBuffer(mBufferType[buffer], mUBO[buffer], data, gl::int32(offset), gl::sizei(size));
+	}
+}
+
+void SpriteBatch::FramePacket::clear()
+{
+	mUploads.clear();
+	mBytes.clear();
+	mCommands.clear();
+	mCapacity = 0;
+	bNewCommands = false;
+	bWriteSlice = false;
+}
+
+void SpriteBatch::FramePacket::record(Uniform buffer, size_t offset, const uint8_t* source, size_t size)
+{
+	const Upload upload = { buffer, offset, size, mBytes.size() };
+	mUploads.push_back(upload);
+	mBytes.insert(mBytes.end(), source, source + size);
+}
+
+void SpriteBatch::bindInstanceBuffers(size_t ring_index)
+{
+	// bind buffers, persistent ones by the slice last written
+	for (gl::uint32 ui = 0; ui < eUBO_MAX; ++ui) {
+		if (!mUBO[ui]) {
+			continue;
+		}
+
+		if (mMappedPtr[ui]) {
+			glBindBufferRange(mBufferType[ui], ui, mUBO[ui],
+				ring_index * mSliceSize[ui], mSliceSize[ui]);
+		}
+		else {
+			glBindBufferBase(mBufferType[ui], ui, mUBO[ui]);
+		}
+	}
+}
+
+void SpriteBatch::draw()
+{
+	mDrawnTime = mTime;
+	drawFrame(captureFrameState());
+}
+
+bool SpriteBatch::needsRedraw() const
+{
+	if (bDirtyTemplates || bDirtyDrawList || bDirtyVisibility || !mStaleRange.isEmpty()) {
+		return true;
+	}
+
+	// Changes the slice last written misses
+	for (const Uniform ui : mStreamedBuffers) {
+		if (!mDirtyRanges[mRingIndex][ui].isEmpty()) {
+			return true;
+		}
+	}
+
+	// Tweens are functions of time, until the last one has been drawn at its end
+	return mDrawnTime < mTweensEnd;
+}
+
+SpriteBatch::FrameState SpriteBatch::captureFrameState() const
+{
+	FrameState state;
+	state.mTime = mTime;
+	state.mRingIndex = mRingIndex;
+	state.mViewport = mViewport;
+	state.mInstanceCount = getVisibleCount();
+	state.mCullCount = mDrawList.size();
+	state.mLayerCount = mNumLayers;
+	state.mCommandCount = mDrawCommands.size();
+	return state;
+}
+
+void SpriteBatch::drawFrame(const FrameState& state)
+{
+	// Flushing is all a headless batch does
+	if (bHeadless) {
+		return;
+	}
+
+	// Culling passes included
+	PROFILE_SCOPE("SpriteBatch::draw");
+	PROFILE_GPU_SCOPE("SpriteBatch::draw");
+
+	// cull against the buffers just flushed
+	if (mCullMode == eCM_GPU) {
+		dispatchCulling(state);
+	}
+
+	// bind shader programs
+	glBindProgramPipeline(mGraphicsPipe.getPipeId());
+	bindInstanceBuffers(state.mRingIndex);
+
+	// the compacted instances are drawn in place of the uploaded ones
+	if (mCullMode == eCM_GPU) {
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, eUBO_INSTANCE, mVisibleBuffer);
+	}
+
+	// time the tweens are evaluated at
+	if (mInstanceFormat == eIF_COMPACT) {
+		glProgramUniform1f(mGraphicsPipe.getPorgId(), TIME_UNIFORM_LOCATION, state.mTime);
+	}
+
+	// bind texture
+	glBindTextures(0, 1, &mTexId);
+
+	// bind the vertex array buffer, which is required
+	glBindVertexArray(mVAO);
+
+	// buffer vertex count
+	if (mDrawMode == eDM_MULTI_DRAW_INDIRECT)
+	{
+		// one command per layer, in layer order
+		const size_t n_commands = (mCullMode == eCM_GPU) ? state.mLayerCount : state.mCommandCount;
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, mIndirectBuffer);
+		glMultiDrawArraysIndirect(GL_TRIANGLES, nullptr, gl::sizei(n_commands), 0);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	}
+	else if (mCullMode == eCM_GPU)
+	{
+		// the instance count is only known to the GPU
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, mIndirectBuffer);
+		glDrawArraysIndirect(GL_TRIANGLES, nullptr);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	}
+	else
+	{
+		glDrawArraysInstanced(GL_TRIANGLES, 0, MAX_VERTICES, gl::sizei(state.mInstanceCount));
+	}
+
+	// Guard the slice, it can't be overwritten until the GPU is done with it
+	if (mUploadMode == eUM_PERSISTENT_RING)
+	{
+		if (mFences[state.mRingIndex]) {
+			glDeleteSync(mFences[state.mRingIndex]);
+		}
+
+		mFences[state.mRingIndex] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	}
+}
+
+SpriteBatch::Template SpriteBatch::Template::INVALID = {
+	nullptr, INDEX_NONE
+};
+
+const SpriteBatch::Handle SpriteBatch::Handle::INVALID = {
+	uint32_t(INDEX_NONE), 0
+};
+
+size_t SpriteBatch::getDenseIndex(Handle instance) const
+{
+	if (instance.mIndex < mSlots.size())
+	{
+		const Slot& slot = mSlots[instance.mIndex];
+		if (slot.mGeneration == instance.mGeneration) {
+			assert(slot.mDense < mInstances.size());
+			return slot.mDense;
+		}
+	}
+
+	return INDEX_NONE;
+}
+
+bool SpriteBatch::isValidInstance(Handle instance) const
+{
+	return getDenseIndex(instance) != INDEX_NONE;
+}
+
+glm::vec2 SpriteBatch::getInstancePosition(Handle instance) const
+{
+	assert(isValidInstance(instance));
+	glm::vec2 position, scale;
+	glm::vec4 color;
+	float rotation;
+	evaluateInstance(getDenseIndex(instance), position, scale, color, rotation);
+	return position;
+}
+
+glm::vec2 SpriteBatch::getInstanceSize(Handle instance) const
+{
+	assert(isValidInstance(instance));
+	glm::vec2 position, scale;
+	glm::vec4 color;
+	float rotation;
+	evaluateInstance(getDenseIndex(instance), position, scale, color, rotation);
+	return scale;
+}
+
+float SpriteBatch::getInstanceRotation(Handle instance) const
+{
+	assert(isValidInstance(instance));
+	glm::vec2 position, scale;
+	glm::vec4 color;
+	float rotation;
+	evaluateInstance(getDenseIndex(instance), position, scale, color, rotation);
+	return rotation;
+}
+
+glm::vec4 SpriteBatch::getInstanceColor(Handle instance) const
+{
+	assert(isValidInstance(instance));
+	glm::vec2 position, scale;
+	glm::vec4 color;
+	float rotation;
+	evaluateInstance(getDenseIndex(instance), position, scale, color, rotation);
+	return color;
+}
+
+const SpriteBatch::Template& SpriteBatch::getInstanceTemplate(Handle instance) const
+{
+	assert(isValidInstance(instance));
+	return mTemplates[mInstances[getDenseIndex(instance)].mTemplateId];
+}
+
+const SpriteBatch::Template& SpriteBatch::createTemplate(glm::vec4 atlas_offsets,
+	uint32_t layer, uint32_t flags)
+{
+	float left = atlas_offsets.x;
+	float top = atlas_offsets.y;
+	float right = atlas_offsets.z;
+	float bottom = atlas_offsets.w;
+
+	// Interleaved array of vertex
+	// positions and texture coordinates
+	const glm::vec4 vbo[MAX_VERTICES] = {
+		glm::vec4(0.0f, 1.0f, left, top),
+		glm::vec4(1.0f, 0.0f, right, bottom),
+		glm::vec4(0.0f, 0.0f, left, bottom),
+
+		glm::vec4(0.0f, 1.0f, left, top),
+		glm::vec4(1.0f, 1.0f, right, top),
+		glm::vec4(1.0f, 0.0f, right, bottom)
+	};
+
+	// we can't add more than the maximum templates
+	if (mTemplates.size() < mMaxTemplates)
+	{
+		Template new_template(vbo, uint32_t(mTemplates.size()), layer, flags);
+		mTemplates.push_back(new_template);
+		mNumLayers = std::max(mNumLayers, layer + 1);
+
+		bDirtyTemplates = true;
+		return mTemplates.back();
+	}
+
+	return SpriteBatch::Template::INVALID;
+}
+
+bool SpriteBatch::swapInstanceTemplate(Handle instance, const Template & new_template)
+{
+	const size_t dense_id = getDenseIndex(instance);
+	if (new_template.isValid() && dense_id != INDEX_NONE)
+	{
+		assert(new_template.mTemplateId < mTemplates.size());
+
+		// nothing to sort, nor to upload
+		if (mInstances[dense_id].mTemplateId == new_template.mTemplateId) {
+			return true;
+		}
+
+		mInstances[dense_id].mTemplateId = new_template.mTemplateId;
+		mInstances[dense_id].mLayer = new_template.mLayer;
+		mInstances[dense_id].mFlags = new_template.mFlags;
+
+		const uint16_t depth = uint16_t(mSortKeys[dense_id] >> 40);
+		mSortKeys[dense_id] = makeSortKey(new_template.mLayer, depth,
+			new_template.mTemplateId, instance.mIndex);
+
+		markDirty(eUBO_INSTANCE, dense_id);
 		return true;
 	}
 
 	return false;
 }
 
-void SpriteBatch::removeInstance(const std::shared_ptr<Instance>& sprite_ref)
+SpriteBatch::Handle SpriteBatch::addInstance(const Template& template_ref)
 {
-	// find this reference in the list of our instances
-	auto instance = std::find(mInstances.begin(), mInstances.end(), sprite_ref);
-	if (instance != std::end(mInstances))
+	// storage buffers can grow, uniform blocks are capped to the maximum instances
+	if (mFreeSlot == uint32_t(INDEX_NONE) && mBufferBackend == eBB_STORAGE) {
+		growInstanceBuffers(std::max<size_t>(mMaxInstances * 2, 1));
+	}
+
+	// templates are stored by id
+	if (template_ref.isValid() && template_ref.mTemplateId < mTemplates.size()
+		&& mFreeSlot != uint32_t(INDEX_NONE))
 	{
-		assert((*instance)->isValid());
-		assert((*instance) == mInstances[(*instance)->mDataId]);
-		assert((*instance)->mDataId < mData.size());
-		assert(mData.size() == mInstances.size());
+		assert(mInstances.size() < mMaxInstances);
+
+		// pop a slot from the free list
+		const uint32_t slot_id = mFreeSlot;
+		Slot& slot = mSlots[slot_id];
+		mFreeSlot = slot.mDense;
+
+		// and point it to the back of the dense arrays
+		const uint32_t dense_id = uint32_t(mInstances.size());
+		slot.mDense = dense_id;
+
+		// collapsed, hence invisible, until updated
+		mInstances.push_back({ template_ref.mTemplateId, dense_id,
+			template_ref.mLayer, template_ref.mFlags });
+		mPositions.push_back(glm::vec2(0.f));
+		mScales.push_back(glm::vec2(0.f));
+		mRotations.push_back(0.f);
+		mColors.push_back(glm::vec4(1.f));
+		mData.resize(mData.size() + mDataStride);
+		mTweens.push_back(Tween());
+		mTweens.back().mDuration = 0.f;
+		mTweenData.push_back(TweenData());
+		mSortKeys.push_back(makeSortKey(template_ref.mLayer, 0, template_ref.mTemplateId, slot_id));
+		mDenseToSlot.push_back(slot_id);
+
+		mStaleRange.add(dense_id, 1);
+		encodeTween(dense_id);
+
+		markDirty(eUBO_INSTANCE, dense_id);
+		markDirty(eUBO_DATA, dense_id);
+		markDirty(eUBO_TWEEN, dense_id);
+
+		return { slot_id, slot.mGeneration };
+	}
 
-		// swap the instance pointed by Instance::mDataId
-		// in the data array with last one
-		auto data_id = (*instance)->mDataId;
-		auto swap_id = mData.size() - 1;
-		
-		// swap algorithm only if not last instance
-		if (data_id != swap_id)
+	// return an invalid object
+	return Handle::INVALID;
+}
+
+void SpriteBatch::encodeData(size_t data_id)
+{
+	glm::vec2 position = mPositions[data_id];
+	glm::vec2 scale = mScales[data_id];
+	float rotation = mRotations[data_id];
+	glm::vec4 color = mColors[data_id];
+
+	uint8_t* record = &mData[data_id * mDataStride];
+
+	if (mInstanceFormat == eIF_COMPACT)
+	{
+		// the vertex shader rebuilds the transform below,
+		// and applies the tween on top of this start state
+		CompactData* compact = reinterpret_cast<CompactData*>(record);
+		compact->mPosition = position;
+		compact->mScale = glm::packHalf2x16(scale);
+		compact->mRotation = rotation;
+		compact->mColor = glm::packUnorm4x8(color);
+	}
+	else
+	{
+		// the transform is baked, hence it has to be the tweened one
+		evaluateInstance(data_id, position, scale, color, rotation);
+
+		// translate * rotate around the centre * scale, in closed form
+		const float c = std::cos(rotation);
+		const float s = std::sin(rotation);
+		const glm::vec2 centre = 0.5f * scale;
+		const glm::vec2 offset = position + centre - glm::vec2(
+			c * centre.x - s * centre.y,
+			s * centre.x + c * centre.y);
+
+		Data* data = reinterpret_cast<Data*>(record);
+		data->mTransform = glm::mat4(
+			c * scale.x, s * scale.x, 0.f, 0.f,
+			-s * scale.y, c * scale.y, 0.f, 0.f,
+			0.f, 0.f, 1.f, 0.f,
+			offset.x, offset.y, 0.f, 1.f);
+		data->mColor = color;
+	}
+}
+
+void SpriteBatch::encodeTween(size_t data_id)
+{
+	const Tween& tween = mTweens[data_id];
+	TweenData& tween_data = mTweenData[data_id];
+
+	tween_data.mPosition = tween.mPosition;
+	tween_data.mScale = glm::packHalf2x16(tween.mScale);
+	tween_data.mRotation = tween.mRotation;
+	tween_data.mColor = glm::packUnorm4x8(tween.mColor);
+	tween_data.mStartTime = tween.mStartTime;
+	tween_data.mDuration = tween.mDuration;
+	tween_data.mEasing = uint32_t(tween.mEasing);
+}
+
+void SpriteBatch::evaluateInstance(size_t data_id, glm::vec2& position,
+	glm::vec2& scale, glm::vec4& color, float& rotation) const
+{
+	position = mPositions[data_id];
+	scale = mScales[data_id];
+	color = mColors[data_id];
+	rotation = mRotations[data_id];
+
+	const Tween& tween = mTweens[data_id];
+	if (tween.mDuration > 0.f)
+	{
+		const float t = applyEasing(glm::clamp(
+			(mTime - tween.mStartTime) / tween.mDuration, 0.f, 1.f), tween.mEasing);
+
+		position = glm::mix(position, tween.mPosition, t);
+		scale = glm::mix(scale, tween.mScale, t);
+		color = glm::mix(color, tween.mColor, t);
+		rotation = glm::mix(rotation, tween.mRotation, t);
+	}
+}
+
+void SpriteBatch::advanceTweens()
+{
+	for (size_t i = 0; i < mTweens.size(); ++i)
+	{
+		Tween& tween = mTweens[i];
+		if (tween.mDuration <= 0.f || mTime < tween.mStartTime) {
+			continue;
+		}
+
+		// Over, settle onto the end state
+		if (mTime >= tween.mStartTime + tween.mDuration)
 		{
-			// swap data
-			mData[data_id] = mData[swap_id];
+			mPositions[i] = tween.mPosition;
+			mScales[i] = tween.mScale;
+			mColors[i] = tween.mColor;
+			mRotations[i] = tween.mRotation;
+
+			tween.mDuration = 0.f;
+			encodeTween(i);
+			markDirty(eUBO_TWEEN, i);
+		}
+
+		mStaleRange.add(i, 1);
+		markDirty(eUBO_DATA, i);
+	}
+}
+
+const uint8_t* SpriteBatch::getBufferSource(Uniform buffer, size_t& elem_size, size_t& elem_count) const
+{
+	switch (buffer)
+	{
+	case eUBO_INSTANCE:
+	{
+		// culling on the CPU uploads the visible instances only
+		const std::vector<Instance>& draw_list = (mCullMode == eCM_CPU) ? mVisibleList : mDrawList;
+		elem_size = sizeof(Instance);
+		elem_count = draw_list.size();
+		return reinterpret_cast<const uint8_t*>(draw_list.data());
+	}
+	case eUBO_DATA:
+		elem_size = mDataStride;
+		elem_count = mInstances.size();
+		return mData.data();
+	case eUBO_TWEEN:
+		elem_size = sizeof(TweenData);
+		elem_count = mInstances.size();
+		return reinterpret_cast<const uint8_t*>(mTweenData.data());
+	default:
+		assert(0); // Not streamed from the instances
+	}
+
+	elem_size = 0;
+	elem_count = 0;
+	return nullptr;
+}
+
+size_t SpriteBatch::getElementSize(Uniform buffer) const
+{
+	switch (buffer)
+	{
+	case eUBO_INSTANCE:
+		return sizeof(Instance);
+	case eUBO_DATA:
+		return mDataStride;
+	case eUBO_TWEEN:
+		return sizeof(TweenData);
+	default:
+		assert(0); // Not streamed from the instances
+	}
 
-			// swap instances
-			mInstances[data_id] = mInstances[swap_id];
+	return 0;
+}
+
+void SpriteBatch::encodeStaleData()
+{
+	const size_t range_end = std::min(mStaleRange.mEnd, mInstances.size());
+	for (size_t i = mStaleRange.mBegin; i < range_end; ++i) {
+		encodeData(i);
+	}
+
+	mStaleRange.reset();
+}
 
-			// force instance to update its data reference
-			mInstances[data_id]->mDataId = data_id;
+bool SpriteBatch::updateInstance(Handle instance,
+	glm::vec2 position, glm::vec2 scale, glm::vec4 color, float rotation)
+{
+	const size_t data_id = getDenseIndex(instance);
+	if (data_id != INDEX_NONE)
+	{
+		mPositions[data_id] = position;
+		mScales[data_id] = scale;
+		mRotations[data_id] = rotation;
+		mColors[data_id] = color;
+
+		// the record is encoded at flush time
+		mStaleRange.add(data_id, 1);
+		markDirty(eUBO_DATA, data_id);
+
+		// cancel any running tween
+		if (mTweens[data_id].mDuration > 0.f) {
+			mTweens[data_id].mDuration = 0.f;
+			encodeTween(data_id);
+			markDirty(eUBO_TWEEN, data_id);
 		}
 
-		// pop from data and instance from the lists
-		mData.pop_back();
-		mInstances.pop_back();
+		return true;
+	}
+
+	return false;
+}
+
+bool SpriteBatch::tweenInstance(Handle instance,
+	glm::vec2 position, glm::vec2 scale, glm::vec4 color, float rotation,
+	float start_time, float duration, Easing easing)
+{
+	const size_t data_id = getDenseIndex(instance);
+	if (data_id == INDEX_NONE) {
+		return false;
+	}
+
+	if (duration <= 0.f) {
+		return updateInstance(instance, position, scale, color, rotation);
+	}
+
+	// Start from where the instance is now, even if half way through a tween
+	if (mTweens[data_id].mDuration > 0.f)
+	{
+		evaluateInstance(data_id, mPositions[data_id], mScales[data_id],
+			mColors[data_id], mRotations[data_id]);
+
+		mStaleRange.add(data_id, 1);
+		markDirty(eUBO_DATA, data_id);
+	}
+
+	Tween& tween = mTweens[data_id];
+	tween.mPosition = position;
+	tween.mScale = scale;
+	tween.mColor = color;
+	tween.mRotation = rotation;
+	tween.mStartTime = start_time;
+	tween.mDuration = duration;
+	tween.mEasing = easing;
+
+	encodeTween(data_id);
+	markDirty(eUBO_TWEEN, data_id);
+
+	mTweensEnd = std::max(mTweensEnd, start_time + duration);
+	return true;
+}
+
+bool SpriteBatch::setInstanceDepth(Handle instance, uint16_t depth)
+{
+	const size_t dense_id = getDenseIndex(instance);
+	if (dense_id != INDEX_NONE)
+	{
+		const Instance& record = mInstances[dense_id];
+		const uint64_t sort_key = makeSortKey(record.mLayer, depth, record.mTemplateId, instance.mIndex);
+
+		// Sort again only if the order might have changed
+		if (sort_key != mSortKeys[dense_id]) {
+			mSortKeys[dense_id] = sort_key;
+			markDirty(eUBO_INSTANCE, dense_id);
+		}
+
+		return true;
+	}
+
+	return false;
+}
+
+uint16_t SpriteBatch::getInstanceDepth(Handle instance) const
+{
+	assert(isValidInstance(instance));
+	return uint16_t(mSortKeys[getDenseIndex(instance)] >> 40);
+}
+
+bool SpriteBatch::isInstanceTweening(Handle instance) const
+{
+	const size_t data_id = getDenseIndex(instance);
+	if (data_id != INDEX_NONE)
+	{
+		const Tween& tween = mTweens[data_id];
+		return tween.mDuration > 0.f && mTime < tween.mStartTime + tween.mDuration;
+	}
+
+	return false;
+}
+
+void SpriteBatch::removeInstance(Handle instance)
+{
+	const size_t dense_id = getDenseIndex(instance);
+	if (dense_id != INDEX_NONE)
+	{
+		assert(mData.size() == mInstances.size() * mDataStride);
+		assert(mDenseToSlot[dense_id] == instance.mIndex);
 
-		bDirtyInstances = true;
+		// swap the instance with the last one in the dense arrays
+		const size_t swap_id = mInstances.size() - 1;
+
+		// swap algorithm only if not last instance
+		if (dense_id != swap_id)
+		{
+			mInstances[dense_id] = mInstances[swap_id];
+			mInstances[dense_id].mDataId = uint32_t(dense_id);
+			mPositions[dense_id] = mPositions[swap_id];
+			mScales[dense_id] = mScales[swap_id];
+			mRotations[dense_id] = mRotations[swap_id];
+			mColors[dense_id] = mColors[swap_id];
+			mTweens[dense_id] = mTweens[swap_id];
+			mTweenData[dense_id] = mTweenData[swap_id];
+			mSortKeys[dense_id] = mSortKeys[swap_id];
+			mStaleRange.add(dense_id, 1);
+
+			// redirect the slot of the moved instance
+			mDenseToSlot[dense_id] = mDenseToSlot[swap_id];
+			mSlots[mDenseToSlot[dense_id]].mDense = uint32_t(dense_id);
+
+			markDirty(eUBO_INSTANCE, dense_id);
+			markDirty(eUBO_DATA, dense_id);
+			markDirty(eUBO_TWEEN, dense_id);
+		}
+
+		// pop from the dense arrays,
+		// trailing elements don't need to be uploaded
+		mInstances.pop_back();
+		mPositions.pop_back();
+		mScales.pop_back();
+		mRotations.pop_back();
+		mColors.pop_back();
+		mData.resize(mData.size() - mDataStride);
+		mTweens.pop_back();
+		mTweenData.pop_back();
+		mSortKeys.pop_back();
+		mDenseToSlot.pop_back();
+
+		// the draw list still holds the removed instance, last or not,
+		// and so do the cull grid and the visible list
+		bDirtyDrawList = true;
+		bDirtyBounds = true;
+		bDirtyVisibility = true;
+
+		// invalidate outstanding handles and push the slot to the free list
+		Slot& slot = mSlots[instance.mIndex];
+		++slot.mGeneration;
+		slot.mDense = mFreeSlot;
+		mFreeSlot = instance.mIndex;
 	}
 }
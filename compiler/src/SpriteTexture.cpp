@@ -122,9 +122,24 @@ bool SpriteTexture::create(const char * filename)
 	return mTextureId != 0;
 }
 
+bool SpriteTexture::load(const char * filename)
+{
+	mTextureId = 0;
+	mTexture.reset();
+
+	if (filename) {
+		mTexture.reset(new gli::texture(gli::load(filename)));
+		if (mTexture->empty()) {
+			mTexture.reset();
+		}
+	}
+
+	return mTexture.get() != nullptr;
+}
+
 void SpriteTexture::destroy()
 {
-	if(glIsTexture(mTextureId))
+	if(mTextureId && glIsTexture(mTextureId))
 	{
 		glDeleteTextures(1, &mTextureId);
 		mTextureId = 0;
@@ -0,0 +1,95 @@
+#include "SpriteTextureArray.hpp"
+#include "SpriteTexture.hpp"
+#include "OGL.hpp"
+
+#include <cassert>
+#include <cmath>
+#include <algorithm>
+
+namespace
+{
+	gl::int32 levelsOf(gl::int32 width, gl::int32 height)
+	{
+		return 1 + static_cast<gl::int32>(floor(log2(std::max(width, height))));
+	}
+}
+
+bool SpriteTextureArray::create(const SpriteTexture* const* textures, size_t count)
+{
+	mTextureId = 0;
+	mWidth = 0;
+	mHeight = 0;
+	mLayerScales.clear();
+
+	if (!textures || count == 0) {
+		return false;
+	}
+
+	// Layers are as big as the biggest texture
+	for (size_t li = 0; li < count; ++li) {
+		assert(textures[li] && glIsTexture(textures[li]->getTexId()));
+		mWidth = std::max(mWidth, textures[li]->getWidth());
+		mHeight = std::max(mHeight, textures[li]->getHeight());
+	}
+
+	glGenTextures(1, &mTextureId);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, mTextureId);
+	glTexStorage3D(GL_TEXTURE_2D_ARRAY, levelsOf(mWidth, mHeight), GL_RGBA8,
+		mWidth, mHeight, gl::sizei(count));
+
+	// The driver decompresses the textures while reading them back. Rows are
+	// read with the stride of the layer, the area left over stays transparent.
+	std::vector<uint8_t> layer_pixels(size_t(mWidth) * size_t(mHeight) * 4);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glPixelStorei(GL_PACK_ROW_LENGTH, mWidth);
+
+	for (size_t li = 0; li < count; ++li)
+	{
+		const int32_t width = textures[li]->getWidth();
+		const int32_t height = textures[li]->getHeight();
+
+		std::fill(layer_pixels.begin(), layer_pixels.end(), uint8_t(0));
+		glBindTexture(GL_TEXTURE_2D, textures[li]->getTexId());
+		glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, layer_pixels.data());
+
+		glBindTexture(GL_TEXTURE_2D_ARRAY, mTextureId);
+		glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, gl::int32(li),
+			mWidth, mHeight, 1, GL_RGBA, GL_UNSIGNED_BYTE, layer_pixels.data());
+
+		mLayerScales.push_back(glm::vec2(
+			float(width) / float(mWidth), float(height) / float(mHeight)));
+	}
+
+	glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+	return mTextureId != 0;
+}
+
+void SpriteTextureArray::destroy()
+{
+	if (glIsTexture(mTextureId))
+	{
+		glDeleteTextures(1, &mTextureId);
+		mTextureId = 0;
+	}
+
+	mLayerScales.clear();
+}
+
+glm::vec2 SpriteTextureArray::getLayerScale(size_t layer) const
+{
+	assert(layer < mLayerScales.size());
+	return mLayerScales[layer];
+}
+
+SpriteTextureArray::~SpriteTextureArray() {
+}
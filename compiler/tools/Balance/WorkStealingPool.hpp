@@ -0,0 +1,225 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Threads working through ranges of indices. Each thread keeps a deque of
+// ranges, it splits the one it takes in halves, down to the grain, keeping
+// the lower half and queueing the upper one. It takes from the back of its
+// own deque, the smallest and most recently split ranges, and once empty
+// steals from the front of the others, the largest ranges left.
+class WorkStealingPool
+{
+
+public:
+
+	// Called with the thread index, and [first, last)
+	typedef std::function<void(size_t, uint64_t, uint64_t)> Body;
+
+	explicit WorkStealingPool(size_t threads);
+	~WorkStealingPool();
+
+	size_t getThreadCount() const { return mWorkers.size(); }
+
+	// Ranges taken from the deque of another thread, since the pool started
+	uint64_t getStealCount() const { return mSteals.load(); }
+
+	// Runs body over [first, last), in ranges of grain indices at most,
+	// and returns once all of them are done. One call at a time.
+	void parallelFor(uint64_t first, uint64_t last, uint64_t grain, const Body& body);
+
+private:
+
+	struct Range
+	{
+		uint64_t	mFirst;
+		uint64_t	mLast;
+	};
+
+	struct Worker
+	{
+		std::mutex			mMutex;
+		std::deque<Range>	mRanges;
+		std::thread			mThread;
+	};
+
+	void push(size_t worker, Range range);
+	bool pop(size_t worker, Range& range);
+	bool steal(size_t worker, Range& range);
+	void run(size_t worker, Range range);
+	void loop(size_t worker);
+
+	std::vector<std::unique_ptr<Worker>>	mWorkers;
+
+	const Body*					mBody;
+	uint64_t					mGrain;
+
+	// Ranges queued, and indices left to run, of the current parallelFor
+	std::atomic<uint64_t>		mQueued;
+	std::atomic<uint64_t>		mRemaining;
+	std::atomic<uint64_t>		mSteals;
+
+	// Idle threads wait for ranges to be queued, the caller for all to be done
+	std::mutex					mWakeMutex;
+	std::condition_variable		mWake;
+	std::atomic<uint32_t>		mSleeping;
+	std::condition_variable		mDone;
+	bool						bQuit;
+};
+
+inline WorkStealingPool::WorkStealingPool(size_t threads)
+	: mBody(nullptr)
+	, mGrain(1)
+	, mQueued(0)
+	, mRemaining(0)
+	, mSteals(0)
+	, mSleeping(0)
+	, bQuit(false)
+{
+	for (size_t t = 0; t < std::max<size_t>(threads, 1); ++t) {
+		mWorkers.emplace_back(new Worker());
+	}
+
+	// Only started once all the deques exist, as they steal from each other
+	for (size_t t = 0; t < mWorkers.size(); ++t) {
+		mWorkers[t]->mThread = std::thread(&WorkStealingPool::loop, this, t);
+	}
+}
+
+inline WorkStealingPool::~WorkStealingPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mWakeMutex);
+		bQuit = true;
+	}
+
+	mWake.notify_all();
+	for (auto& worker : mWorkers) {
+		worker->mThread.join();
+	}
+}
+
+inline void WorkStealingPool::parallelFor(uint64_t first, uint64_t last, uint64_t grain, const Body& body)
+{
+	if (first >= last) {
+		return;
+	}
+
+	mBody = &body;
+	mGrain = std::max<uint64_t>(grain, 1);
+	mRemaining = last - first;
+
+	// A share each to start with, the threads balance the rest by stealing
+	const uint64_t threads = mWorkers.size();
+	for (uint64_t t = 0; t < threads; ++t) {
+		const Range share = {
+			first + (last - first) * t / threads,
+			first + (last - first) * (t + 1) / threads };
+
+		if (share.mFirst < share.mLast) {
+			push(size_t(t), share);
+		}
+	}
+
+	std::unique_lock<std::mutex> lock(mWakeMutex);
+	mDone.wait(lock, [this] { return mRemaining.load() == 0; });
+	mBody = nullptr;
+}
+
+inline void WorkStealingPool::push(size_t worker, Range range)
+{
+	// Counted before it is queued, so that the count is never short
+	{
+		std::lock_guard<std::mutex> lock(mWorkers[worker]->mMutex);
+		mQueued.fetch_add(1);
+		mWorkers[worker]->mRanges.push_back(range);
+	}
+
+	// Sleepers count themselves before checking the queue, under the wake
+	// mutex, hence either they see the range or they are woken for it.
+	if (mSleeping.load() > 0) {
+		std::lock_guard<std::mutex> lock(mWakeMutex);
+		mWake.notify_one();
+	}
+}
+
+inline bool WorkStealingPool::pop(size_t worker, Range& range)
+{
+	std::lock_guard<std::mutex> lock(mWorkers[worker]->mMutex);
+	auto& ranges = mWorkers[worker]->mRanges;
+	if (ranges.empty()) {
+		return false;
+	}
+
+	range = ranges.back();
+	ranges.pop_back();
+	mQueued.fetch_sub(1);
+	return true;
+}
+
+inline bool WorkStealingPool::steal(size_t worker, Range& range)
+{
+	for (size_t v = 1; v < mWorkers.size(); ++v)
+	{
+		Worker& victim = *mWorkers[(worker + v) % mWorkers.size()];
+		std::lock_guard<std::mutex> lock(victim.mMutex);
+		if (!victim.mRanges.empty())
+		{
+			range = victim.mRanges.front();
+			victim.mRanges.pop_front();
+			mQueued.fetch_sub(1);
+			mSteals.fetch_add(1);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+inline void WorkStealingPool::run(size_t worker, Range range)
+{
+	// Upper halves go to the deque, where others can steal them
+	while (range.mLast - range.mFirst > mGrain)
+	{
+		const uint64_t middle = range.mFirst + (range.mLast - range.mFirst) / 2;
+		push(worker, Range{ middle, range.mLast });
+		range.mLast = middle;
+	}
+
+	(*mBody)(worker, range.mFirst, range.mLast);
+
+	if (mRemaining.fetch_sub(range.mLast - range.mFirst) == range.mLast - range.mFirst)
+	{
+		std::lock_guard<std::mutex> lock(mWakeMutex);
+		mDone.notify_all();
+	}
+}
+
+inline void WorkStealingPool::loop(size_t worker)
+{
+	for (;;)
+	{
+		Range range;
+		if (pop(worker, range) || steal(worker, range)) {
+			run(worker, range);
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(mWakeMutex);
+		mSleeping.fetch_add(1);
+		mWake.wait(lock, [this] { return bQuit || mQueued.load() > 0; });
+		mSleeping.fetch_sub(1);
+
+		if (bQuit) {
+			return;
+		}
+	}
+}
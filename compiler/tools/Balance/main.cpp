@@ -0,0 +1,730 @@
+// Plays simulated matches on the Board, without rendering them, to balance its
+// rules. Matches run in parallel on a work stealing pool, each one seeded from
+// the seed and its own index, hence the results don't depend on the threads.
+// Each thread plays with its own random stream, and adds what it tallied up
+// into the totals with atomic adds only, once per range of matches.
+//
+// usage: Balance [options], Balance --help lists them
+
+#include "Board.hpp"
+#include "WorkStealingPool.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "format.hpp"
+
+namespace
+{
+	const size_t SCORE_BINS = 64;		// the last one counts all the higher scores
+	const size_t CASCADE_BINS = 16;		// explosion waves after a move, the last one 15 or more
+
+	enum Policy
+	{
+		ePO_RANDOM,
+		ePO_GREEDY
+	};
+
+	struct Options
+	{
+		Board::Rules	mRules;
+		uint64_t		mGames = 10000;
+		size_t			mThreads = std::max(std::thread::hardware_concurrency(), 1u);
+		uint64_t		mSeed = 1;
+		Policy			mPolicy = ePO_GREEDY;
+		float			mMoveTime = 0.5f;
+		float			mStep = 1.f / 120.f;
+		uint32_t		mScoreBin = 25;
+		uint64_t		mGrain = 16;
+		const char*		mCsvFile = nullptr;
+		const char*		mJsonFile = nullptr;
+		bool			bScaling = false;
+		bool			bHelp = false;
+	};
+
+	// Bad command lines, reported along with the usage
+	struct UsageError : std::runtime_error
+	{
+		explicit UsageError(const std::string& message) : std::runtime_error(message) {}
+	};
+
+	// What a thread tallies up over a range of matches
+	struct Tally
+	{
+		uint64_t	mGames = 0;
+		uint64_t	mSteps = 0;
+		uint64_t	mMoves = 0;
+		uint64_t	mExplosions = 0;
+		uint64_t	mScoreSum = 0;
+		uint64_t	mScoreSquares = 0;
+		uint32_t	mScoreMin = UINT32_MAX;
+		uint32_t	mScoreMax = 0;
+		std::array<uint64_t, SCORE_BINS>	mScores = {};
+		std::array<uint64_t, CASCADE_BINS>	mCascades = {};
+	};
+
+	// Shared by all the threads, never locked
+	struct Totals
+	{
+		std::atomic<uint64_t>	mGames;
+		std::atomic<uint64_t>	mSteps;
+		std::atomic<uint64_t>	mMoves;
+		std::atomic<uint64_t>	mExplosions;
+		std::atomic<uint64_t>	mScoreSum;
+		std::atomic<uint64_t>	mScoreSquares;
+		std::atomic<uint32_t>	mScoreMin;
+		std::atomic<uint32_t>	mScoreMax;
+		std::array<std::atomic<uint64_t>, SCORE_BINS>	mScores;
+		std::array<std::atomic<uint64_t>, CASCADE_BINS>	mCascades;
+
+		void reset()
+		{
+			for (auto* counter : { &mGames, &mSteps, &mMoves, &mExplosions, &mScoreSum, &mScoreSquares }) {
+				counter->store(0);
+			}
+
+			mScoreMin.store(UINT32_MAX);
+			mScoreMax.store(0);
+
+			for (auto& bin : mScores) {
+				bin.store(0);
+			}
+
+			for (auto& bin : mCascades) {
+				bin.store(0);
+			}
+		}
+
+		void add(const Tally& tally)
+		{
+			mGames.fetch_add(tally.mGames, std::memory_order_relaxed);
+			mSteps.fetch_add(tally.mSteps, std::memory_order_relaxed);
+			mMoves.fetch_add(tally.mMoves, std::memory_order_relaxed);
+			mExplosions.fetch_add(tally.mExplosions, std::memory_order_relaxed);
+			mScoreSum.fetch_add(tally.mScoreSum, std::memory_order_relaxed);
+			mScoreSquares.fetch_add(tally.mScoreSquares, std::memory_order_relaxed);
+
+			// Retried until no other thread changed them in between
+			uint32_t score_min = mScoreMin.load(std::memory_order_relaxed);
+			while (tally.mScoreMin < score_min
+				&& !mScoreMin.compare_exchange_weak(score_min, tally.mScoreMin, std::memory_order_relaxed)) {
+			}
+
+			uint32_t score_max = mScoreMax.load(std::memory_order_relaxed);
+			while (tally.mScoreMax > score_max
+				&& !mScoreMax.compare_exchange_weak(score_max, tally.mScoreMax, std::memory_order_relaxed)) {
+			}
+
+			for (size_t b = 0; b < SCORE_BINS; ++b) {
+				if (tally.mScores[b]) {
+					mScores[b].fetch_add(tally.mScores[b], std::memory_order_relaxed);
+				}
+			}
+
+			for (size_t b = 0; b < CASCADE_BINS; ++b) {
+				if (tally.mCascades[b]) {
+					mCascades[b].fetch_add(tally.mCascades[b], std::memory_order_relaxed);
+				}
+			}
+		}
+	};
+
+	// Per thread, reseeded for every match
+	struct Player
+	{
+		std::mt19937 mRandom;
+	};
+
+	const char* getPolicyName(Policy policy)
+	{
+		return policy == ePO_GREEDY ? "greedy" : "random";
+	}
+
+	bool isReady(const Board& board, int32_t index)
+	{
+		return board.getState(index) == Board::DiamondState::READY;
+	}
+
+	// Whether the diamond of index, in a colour, would be part of a run once
+	// first and second are swapped. Only ready diamonds, and the two swapped,
+	// are counted, as the others can't match.
+	bool makesRun(const Board& board, int32_t index, uint8_t colour, int32_t first, int32_t second)
+	{
+		auto colourAt = [&](int32_t cell) -> int32_t {
+			if (cell == first) {
+				return board.getColour(second);
+			}
+			if (cell == second) {
+				return board.getColour(first);
+			}
+			return isReady(board, cell) ? board.getColour(cell) : -1;
+		};
+
+		const int32_t column = board.getColumn(index);
+		const int32_t row = board.getRow(index);
+
+		int32_t run = 1;
+		for (int32_t x = column - 1; x >= 0 && colourAt(board.getIndex(x, row)) == colour; --x) {
+			++run;
+		}
+		for (int32_t x = column + 1; x < board.getWidth() && colourAt(board.getIndex(x, row)) == colour; ++x) {
+			++run;
+		}
+
+		if (run >= board.getRules().mMatchLength) {
+			return true;
+		}
+
+		run = 1;
+		for (int32_t y = row - 1; y >= 0 && colourAt(board.getIndex(column, y)) == colour; --y) {
+			++run;
+		}
+		for (int32_t y = row + 1; y < board.getHeight() && colourAt(board.getIndex(column, y)) == colour; ++y) {
+			++run;
+		}
+
+		return run >= board.getRules().mMatchLength;
+	}
+
+	// Ready neighbour of a ready diamond, in a random direction
+	bool chooseRandomMove(const Board& board, Player& player, int32_t& first, int32_t& second)
+	{
+		static const int32_t Directions[4][2] = { { 1, 0 }, { -1, 0 }, { 0, 1 }, { 0, -1 } };
+		std::uniform_int_distribution<int32_t> cell_dis(0, board.getSize() - 1);
+		std::uniform_int_distribution<int32_t> direction_dis(0, 3);
+
+		// Probed rather than listed, boards can be large
+		for (int32_t attempt = 0; attempt < 64; ++attempt)
+		{
+			const int32_t cell = cell_dis(player.mRandom);
+			const int32_t* direction = Directions[direction_dis(player.mRandom)];
+			const int32_t x = board.getColumn(cell) + direction[0];
+			const int32_t y = board.getRow(cell) + direction[1];
+
+			if (x >= 0 && x < board.getWidth() && y >= 0 && y < board.getHeight()
+				&& isReady(board, cell) && isReady(board, board.getIndex(x, y)))
+			{
+				first = cell;
+				second = board.getIndex(x, y);
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	// First swap, from a random cell on, that makes a run, a random one if none does
+	bool chooseGreedyMove(const Board& board, Player& player, int32_t& first, int32_t& second)
+	{
+		std::uniform_int_distribution<int32_t> cell_dis(0, board.getSize() - 1);
+		const int32_t start = cell_dis(player.mRandom);
+
+		for (int32_t c = 0; c < board.getSize(); ++c)
+		{
+			const int32_t cell = (start + c) % board.getSize();
+			if (!isReady(board, cell)) {
+				continue;
+			}
+
+			// Right and up, the other directions are the same swaps seen from the neighbour
+			const int32_t x = board.getColumn(cell);
+			const int32_t y = board.getRow(cell);
+			const int32_t neighbours[2] = {
+				x + 1 < board.getWidth() ? cell + 1 : -1,
+				y + 1 < board.getHeight() ? board.getIndex(x, y + 1) : -1 };
+
+			for (int32_t neighbour : neighbours)
+			{
+				if (neighbour < 0 || !isReady(board, neighbour)
+					|| board.getColour(neighbour) == board.getColour(cell)) {
+					continue;
+				}
+
+				if (makesRun(board, cell, board.getColour(neighbour), cell, neighbour)
+					|| makesRun(board, neighbour, board.getColour(cell), cell, neighbour))
+				{
+					first = cell;
+					second = neighbour;
+					return true;
+				}
+			}
+		}
+
+		return chooseRandomMove(board, player, first, second);
+	}
+
+	// One match, from the start to the end of its time. A move is two picks,
+	// on two consecutive steps, the second one swapping.
+	void playMatch(const Options& options, uint64_t match, Player& player, Tally& tally)
+	{
+		std::seed_seq seeds{ uint32_t(options.mSeed), uint32_t(options.mSeed >> 32),
+			uint32_t(match), uint32_t(match >> 32) };
+
+		uint32_t streams[2];
+		seeds.generate(streams, streams + 2);
+
+		Board board(options.mRules, streams[0]);
+		player.mRandom.seed(streams[1]);
+		board.fill();
+
+		Board::Input input;
+		input.bStart = true;
+		board.step(options.mStep, input);
+
+		float move_time = options.mMoveTime;
+		int32_t pending_pick = -1;
+		uint64_t swaps = board.getSwapCount();
+		uint64_t explosions = board.getExplosionCount();
+		int32_t waves = -1;		// none until the first move
+		uint64_t steps = 1;
+
+		while (board.isMatching())
+		{
+			input = Board::Input();
+			if (pending_pick >= 0) {
+				input.mPick = pending_pick;
+				pending_pick = -1;
+			}
+			else if ((move_time -= options.mStep) <= 0.f) {
+				move_time += options.mMoveTime;
+
+				int32_t first, second;
+				const bool moving = options.mPolicy == ePO_GREEDY
+					? chooseGreedyMove(board, player, first, second)
+					: chooseRandomMove(board, player, first, second);
+
+				if (moving) {
+					input.mPick = first;
+					pending_pick = second;
+				}
+			}
+
+			board.step(options.mStep, input);
+			++steps;
+
+			// Cascades are counted from a swap to the next one
+			if (board.getSwapCount() != swaps) {
+				if (waves >= 0) {
+					++tally.mCascades[std::min<size_t>(size_t(waves), CASCADE_BINS - 1)];
+				}
+
+				swaps = board.getSwapCount();
+				waves = 0;
+			}
+
+			if (board.getExplosionCount() != explosions) {
+				explosions = board.getExplosionCount();
+				waves += waves >= 0 ? 1 : 0;
+			}
+		}
+
+		if (waves >= 0) {
+			++tally.mCascades[std::min<size_t>(size_t(waves), CASCADE_BINS - 1)];
+		}
+
+		const uint32_t score = board.getLastScore();
+		++tally.mGames;
+		tally.mSteps += steps;
+		tally.mMoves += board.getSwapCount();
+		tally.mExplosions += board.getExplosionCount();
+		tally.mScoreSum += score;
+		tally.mScoreSquares += uint64_t(score) * score;
+		tally.mScoreMin = std::min(tally.mScoreMin, score);
+		tally.mScoreMax = std::max(tally.mScoreMax, score);
+		++tally.mScores[std::min<size_t>(score / options.mScoreBin, SCORE_BINS - 1)];
+	}
+
+	// Plays all the matches on threads, returns the seconds taken
+	double playMatches(const Options& options, size_t threads, Totals& totals, uint64_t& steals)
+	{
+		totals.reset();
+
+		WorkStealingPool pool(threads);
+		std::vector<Player> players(pool.getThreadCount());
+
+		const auto start = std::chrono::steady_clock::now();
+		pool.parallelFor(0, options.mGames, options.mGrain,
+			[&](size_t thread, uint64_t first, uint64_t last) {
+				Tally tally;
+				for (uint64_t match = first; match < last; ++match) {
+					playMatch(options, match, players[thread], tally);
+				}
+				totals.add(tally);
+			});
+
+		steals = pool.getStealCount();
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	struct Summary
+	{
+		double	mSeconds;
+		double	mGamesPerSecond;
+		double	mScoreMean;
+		double	mScoreDeviation;
+		double	mMovesPerGame;
+		double	mExplosionsPerGame;
+	};
+
+	Summary summarise(const Totals& totals, double seconds)
+	{
+		const double games = double(std::max<uint64_t>(totals.mGames.load(), 1));
+		const double mean = double(totals.mScoreSum.load()) / games;
+		const double variance = double(totals.mScoreSquares.load()) / games - mean * mean;
+
+		Summary summary;
+		summary.mSeconds = seconds;
+		summary.mGamesPerSecond = double(totals.mGames.load()) / std::max(seconds, 1e-9);
+		summary.mScoreMean = mean;
+		summary.mScoreDeviation = std::sqrt(std::max(variance, 0.0));
+		summary.mMovesPerGame = double(totals.mMoves.load()) / games;
+		summary.mExplosionsPerGame = double(totals.mExplosions.load()) / games;
+		return summary;
+	}
+
+	// Weights joined by separator, empty for uniform spawns
+	std::string joinWeights(const std::vector<double>& weights, char separator)
+	{
+		std::string joined;
+		for (size_t w = 0; w < weights.size(); ++w) {
+			joined += (w ? fmt::format("{}{}", separator, weights[w]) : fmt::format("{}", weights[w]));
+		}
+
+		return joined;
+	}
+
+	// Comma separated, as in --spawn-weights 1,1,2,1,1
+	std::vector<double> parseWeights(const char* option, const char* value)
+	{
+		std::vector<double> weights;
+		const char* cursor = value;
+		for (;;)
+		{
+			char* end = nullptr;
+			weights.push_back(strtod(cursor, &end));
+			if (end == cursor || (*end != ',' && *end != '\0')) {
+				throw UsageError(fmt::format("Expected {} <weight>,<weight>..., not {}\n", option, value));
+			}
+
+			if (*end == '\0') {
+				return weights;
+			}
+
+			cursor = end + 1;
+		}
+	}
+
+	void writeCsv(const char* filename, const Options& options, size_t threads, const Totals& totals, const Summary& summary)
+	{
+		// A row per run, so that runs of different rules add up to a table
+		FILE* existing = fopen(filename, "r");
+		const bool header = !existing || fgetc(existing) == EOF;
+		if (existing) {
+			fclose(existing);
+		}
+
+		FILE* file = fopen(filename, "a");
+		if (!file) {
+			throw std::runtime_error(fmt::format("Cannot write {}\n", filename));
+		}
+
+		if (header) {
+			fprintf(file, "width,height,colours,match_length,init_height,falling_time,swapping_time,spawn_time,match_time,"
+				"spawn_weights,column_weights,policy,move_time,step,seed,games,threads,seconds,games_per_second,"
+				"score_mean,score_deviation,score_min,score_max,moves_per_game,explosions_per_game\n");
+		}
+
+		const Board::Rules& rules = options.mRules;
+		fprintf(file, "%d,%d,%d,%d,%d,%g,%g,%g,%g,%s,%s,%s,%g,%g,%llu,%llu,%zu,%.3f,%.1f,%.3f,%.3f,%u,%u,%.3f,%.3f\n",
+			rules.mWidth, rules.mHeight, rules.mColours, rules.mMatchLength, rules.mInitHeight,
+			rules.mFallingTime, rules.mSwappingTime, rules.mSpawnTime, rules.mMatchTime,
+			joinWeights(rules.mColourWeights, ';').c_str(), joinWeights(rules.mColumnWeights, ';').c_str(),
+			getPolicyName(options.mPolicy), options.mMoveTime, options.mStep,
+			(unsigned long long)options.mSeed, (unsigned long long)totals.mGames.load(), threads,
+			summary.mSeconds, summary.mGamesPerSecond, summary.mScoreMean, summary.mScoreDeviation,
+			totals.mScoreMin.load(), totals.mScoreMax.load(), summary.mMovesPerGame, summary.mExplosionsPerGame);
+
+		const bool written = !ferror(file);
+		fclose(file);
+
+		if (!written) {
+			throw std::runtime_error(fmt::format("Cannot write {}\n", filename));
+		}
+	}
+
+	void writeJson(const char* filename, const Options& options, size_t threads, const Totals& totals, const Summary& summary)
+	{
+		FILE* file = fopen(filename, "w");
+		if (!file) {
+			throw std::runtime_error(fmt::format("Cannot write {}\n", filename));
+		}
+
+		const Board::Rules& rules = options.mRules;
+		fprintf(file, "{\n\"rules\":{\"width\":%d,\"height\":%d,\"colours\":%d,\"match_length\":%d,\"init_height\":%d,"
+			"\"falling_time\":%g,\"swapping_time\":%g,\"spawn_time\":%g,\"match_time\":%g,"
+			"\"spawn_weights\":[%s],\"column_weights\":[%s]},\n",
+			rules.mWidth, rules.mHeight, rules.mColours, rules.mMatchLength, rules.mInitHeight,
+			rules.mFallingTime, rules.mSwappingTime, rules.mSpawnTime, rules.mMatchTime,
+			joinWeights(rules.mColourWeights, ',').c_str(), joinWeights(rules.mColumnWeights, ',').c_str());
+
+		fprintf(file, "\"policy\":\"%s\",\"move_time\":%g,\"step\":%g,\"seed\":%llu,\n",
+			getPolicyName(options.mPolicy), options.mMoveTime, options.mStep, (unsigned long long)options.mSeed);
+
+		fprintf(file, "\"games\":%llu,\"threads\":%zu,\"seconds\":%.3f,\"games_per_second\":%.1f,\"steps\":%llu,\n",
+			(unsigned long long)totals.mGames.load(), threads, summary.mSeconds, summary.mGamesPerSecond,
+			(unsigned long long)totals.mSteps.load());
+
+		fprintf(file, "\"moves_per_game\":%.3f,\"explosions_per_game\":%.3f,\n",
+			summary.mMovesPerGame, summary.mExplosionsPerGame);
+
+		fprintf(file, "\"score\":{\"mean\":%.3f,\"deviation\":%.3f,\"min\":%u,\"max\":%u,\"bin_width\":%u,\"histogram\":[",
+			summary.mScoreMean, summary.mScoreDeviation, totals.mScoreMin.load(), totals.mScoreMax.load(), options.mScoreBin);
+		for (size_t b = 0; b < SCORE_BINS; ++b) {
+			fprintf(file, "%s%llu", b ? "," : "", (unsigned long long)totals.mScores[b].load());
+		}
+
+		fprintf(file, "]},\n\"cascades\":[");
+		for (size_t b = 0; b < CASCADE_BINS; ++b) {
+			fprintf(file, "%s%llu", b ? "," : "", (unsigned long long)totals.mCascades[b].load());
+		}
+
+		fprintf(file, "]\n}\n");
+
+		const bool written = !ferror(file);
+		fclose(file);
+
+		if (!written) {
+			throw std::runtime_error(fmt::format("Cannot write {}\n", filename));
+		}
+	}
+
+	void printUsage(FILE* file)
+	{
+		const Options defaults;
+		const Board::Rules& rules = defaults.mRules;
+
+		fprintf(file, "usage: Balance [options]\n");
+		fprintf(file, "  --games <n>                matches to play [%llu]\n", (unsigned long long)defaults.mGames);
+		fprintf(file, "  --threads <n>              [%zu, the cores]\n", defaults.mThreads);
+		fprintf(file, "  --seed <n>                 [%llu]\n", (unsigned long long)defaults.mSeed);
+		fprintf(file, "  --policy <random|greedy>   greedy plays a swap that makes a run, random any swap [%s]\n", getPolicyName(defaults.mPolicy));
+		fprintf(file, "  --move-time <s>            between moves of the player [%g]\n", defaults.mMoveTime);
+		fprintf(file, "  --step <s>                 simulation step, as the game [%g]\n", defaults.mStep);
+		fprintf(file, "  --grid <w>x<h>             [%dx%d]\n", rules.mWidth, rules.mHeight);
+		fprintf(file, "  --colours <n>              [%d]\n", rules.mColours);
+		fprintf(file, "  --match-length <n>         [%d]\n", rules.mMatchLength);
+		fprintf(file, "  --init-height <n>          [%d]\n", rules.mInitHeight);
+		fprintf(file, "  --falling-time <s>         [%g]\n", rules.mFallingTime);
+		fprintf(file, "  --swapping-time <s>        [%g]\n", rules.mSwappingTime);
+		fprintf(file, "  --spawn-time <s>           [%g]\n", rules.mSpawnTime);
+		fprintf(file, "  --match-time <s>           [%g]\n", rules.mMatchTime);
+		fprintf(file, "  --spawn-weights <w,w...>   of each colour spawned, relative [uniform]\n");
+		fprintf(file, "  --column-weights <w,w...>  of each column spawned into, relative [uniform]\n");
+		fprintf(file, "  --score-bin <n>            width of the score histogram bins [%u]\n", defaults.mScoreBin);
+		fprintf(file, "  --grain <n>                matches a range is split down to [%llu]\n", (unsigned long long)defaults.mGrain);
+		fprintf(file, "  --csv <file>               appends a row of the summary, with a header if new\n");
+		fprintf(file, "  --json <file>              writes the summary and the histograms\n");
+		fprintf(file, "  --scaling                  runs again on 1, 2, 4 ... threads, up to --threads\n");
+		fprintf(file, "  -h, --help                 prints this\n");
+	}
+
+	Options parseOptions(int argc, char* argv[])
+	{
+		Options options;
+		for (int a = 1; a < argc; ++a)
+		{
+			const char* option = argv[a];
+			if (strcmp(option, "--scaling") == 0) {
+				options.bScaling = true;
+				continue;
+			}
+
+			if (strcmp(option, "-h") == 0 || strcmp(option, "--help") == 0) {
+				options.bHelp = true;
+				return options;
+			}
+
+			// Told apart from unknown options before the value is looked for
+			static const char* const ValueOptions[] = { "--games", "--threads", "--seed", "--policy",
+				"--move-time", "--step", "--grid", "--colours", "--match-length", "--init-height",
+				"--falling-time", "--swapping-time", "--spawn-time", "--match-time", "--spawn-weights", "--column-weights",
+				"--score-bin", "--grain", "--csv", "--json" };
+
+			if (std::none_of(std::begin(ValueOptions), std::end(ValueOptions),
+				[option](const char* name) { return strcmp(option, name) == 0; })) {
+				throw UsageError(fmt::format("Unknown option {}\n", option));
+			}
+
+			if (a + 1 >= argc) {
+				throw UsageError(fmt::format("Missing the value of {}\n", option));
+			}
+
+			const char* value = argv[++a];
+			Board::Rules& rules = options.mRules;
+
+			if (strcmp(option, "--games") == 0) {
+				options.mGames = strtoull(value, nullptr, 10);
+			}
+			else if (strcmp(option, "--threads") == 0) {
+				options.mThreads = size_t(std::max(atoi(value), 1));
+			}
+			else if (strcmp(option, "--seed") == 0) {
+				options.mSeed = strtoull(value, nullptr, 10);
+			}
+			else if (strcmp(option, "--policy") == 0) {
+				if (strcmp(value, "greedy") == 0) {
+					options.mPolicy = ePO_GREEDY;
+				}
+				else if (strcmp(value, "random") == 0) {
+					options.mPolicy = ePO_RANDOM;
+				}
+				else {
+					throw UsageError(fmt::format("Unknown policy {}\n", value));
+				}
+			}
+			else if (strcmp(option, "--move-time") == 0) {
+				options.mMoveTime = float(atof(value));
+			}
+			else if (strcmp(option, "--step") == 0) {
+				options.mStep = float(atof(value));
+			}
+			else if (strcmp(option, "--grid") == 0) {
+				if (sscanf(value, "%dx%d", &rules.mWidth, &rules.mHeight) != 2) {
+					throw UsageError(fmt::format("Expected --grid <columns>x<rows>, not {}\n", value));
+				}
+			}
+			else if (strcmp(option, "--colours") == 0) {
+				rules.mColours = atoi(value);
+			}
+			else if (strcmp(option, "--match-length") == 0) {
+				rules.mMatchLength = atoi(value);
+			}
+			else if (strcmp(option, "--init-height") == 0) {
+				rules.mInitHeight = atoi(value);
+			}
+			else if (strcmp(option, "--falling-time") == 0) {
+				rules.mFallingTime = float(atof(value));
+			}
+			else if (strcmp(option, "--swapping-time") == 0) {
+				rules.mSwappingTime = float(atof(value));
+			}
+			else if (strcmp(option, "--spawn-weights") == 0) {
+				rules.mColourWeights = parseWeights(option, value);
+			}
+			else if (strcmp(option, "--column-weights") == 0) {
+				rules.mColumnWeights = parseWeights(option, value);
+			}
+			else if (strcmp(option, "--spawn-time") == 0) {
+				rules.mSpawnTime = float(atof(value));
+			}
+			else if (strcmp(option, "--match-time") == 0) {
+				rules.mMatchTime = float(atof(value));
+			}
+			else if (strcmp(option, "--score-bin") == 0) {
+				options.mScoreBin = uint32_t(std::max(atoi(value), 1));
+			}
+			else if (strcmp(option, "--grain") == 0) {
+				options.mGrain = std::max<uint64_t>(strtoull(value, nullptr, 10), 1);
+			}
+			else if (strcmp(option, "--csv") == 0) {
+				options.mCsvFile = value;
+			}
+			else if (strcmp(option, "--json") == 0) {
+				options.mJsonFile = value;
+			}
+			else {
+				throw UsageError(fmt::format("Unknown option {}\n", option));
+			}
+		}
+
+		// A match has to end, and moves have to come
+		if (options.mStep <= 0.f || options.mMoveTime <= 0.f || options.mRules.mMatchTime <= 0.f) {
+			throw std::runtime_error("Step, move and match times have to be positive\n");
+		}
+
+		return options;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	try
+	{
+		const Options options = parseOptions(argc, argv);
+		if (options.bHelp) {
+			printUsage(stdout);
+			return EXIT_SUCCESS;
+		}
+
+		// Rules checked once up front, rather than thrown at by every thread
+		Board(options.mRules, 0);
+
+		Totals totals;
+		uint64_t steals = 0;
+
+		// Same matches on more and more threads, only the throughput changes
+		double single_rate = 0.0;
+		if (options.bScaling)
+		{
+			for (size_t threads = 1; threads < options.mThreads; threads *= 2)
+			{
+				const Summary summary = summarise(totals, playMatches(options, threads, totals, steals));
+				single_rate = threads == 1 ? summary.mGamesPerSecond : single_rate;
+				printf("%4zu threads: %10.1f games/s, %5.2fx\n", threads, summary.mGamesPerSecond,
+					summary.mGamesPerSecond / single_rate);
+			}
+		}
+
+		// The run reported is the one on all the threads
+		const Summary summary = summarise(totals, playMatches(options, options.mThreads, totals, steals));
+		if (options.bScaling)
+		{
+			single_rate = options.mThreads == 1 ? summary.mGamesPerSecond : single_rate;
+			printf("%4zu threads: %10.1f games/s, %5.2fx\n", options.mThreads, summary.mGamesPerSecond,
+				summary.mGamesPerSecond / single_rate);
+		}
+
+		const uint64_t games = totals.mGames.load();
+		printf("%llu %s matches on %zu threads in %.2fs, %.1f games/s, %.2fM steps/s, %llu ranges stolen\n",
+			(unsigned long long)games, getPolicyName(options.mPolicy), options.mThreads, summary.mSeconds,
+			summary.mGamesPerSecond, double(totals.mSteps.load()) / std::max(summary.mSeconds, 1e-9) / 1e6,
+			(unsigned long long)steals);
+
+		printf("score %.1f +- %.1f, from %u to %u, %.1f moves and %.1f explosions a match\n",
+			summary.mScoreMean, summary.mScoreDeviation,
+			games ? totals.mScoreMin.load() : 0, totals.mScoreMax.load(),
+			summary.mMovesPerGame, summary.mExplosionsPerGame);
+
+		if (options.mCsvFile) {
+			writeCsv(options.mCsvFile, options, options.mThreads, totals, summary);
+		}
+
+		if (options.mJsonFile) {
+			writeJson(options.mJsonFile, options, options.mThreads, totals, summary);
+		}
+	}
+	catch (UsageError& e)
+	{
+		fprintf(stderr, "%s", e.what());
+		printUsage(stderr);
+		return EXIT_FAILURE;
+	}
+	catch (std::exception& e)
+	{
+		fprintf(stderr, "%s", e.what());
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
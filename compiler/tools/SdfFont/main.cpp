@@ -0,0 +1,237 @@
+// Converts the bitmap font atlas into a single channel signed distance field
+// atlas, as sampled by font_sdf.frag and by sprite.frag for eTF_DISTANCE_FIELD
+// templates. The glyph layout is kept, only scaled down, hence the Font metrics
+// still apply as long as texture coordinates are normalised by the atlas size
+// given in Font.h. Each glyph only sees its own texels, so neighbouring glyphs
+// never bleed into each other however close they are packed.
+//
+// usage: SdfFont <atlas.dds> <sdf_atlas.dds> [downscale] [spread]
+//   downscale	source texels per distance field texel, 4 by default
+//   spread		distance field texels the edge ramp extends to each side, 4 by default
+
+#include <king/Font.h>
+#include <gli/gli.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include "format.hpp"
+
+namespace
+{
+	// Coverage of each texel, from 0 to 255
+	struct Bitmap
+	{
+		int32_t mWidth;
+		int32_t mHeight;
+		std::vector<uint8_t> mTexels;
+
+		uint8_t at(int32_t x, int32_t y) const {
+			return mTexels[size_t(y) * size_t(mWidth) + size_t(x)];
+		}
+	};
+
+	// Red channel of a 5:6:5 colour, expanded to 8 bits
+	uint8_t red565(uint16_t color)
+	{
+		const uint32_t red = (color >> 11) & 0x1f;
+		return uint8_t((red << 3) | (red >> 2));
+	}
+
+	// The font is greyscale, hence the red channel of the BC1 blocks is enough
+	void decodeBC1(const uint8_t* blocks, Bitmap& bitmap)
+	{
+		const int32_t blocks_x = (bitmap.mWidth + 3) / 4;
+		const int32_t blocks_y = (bitmap.mHeight + 3) / 4;
+
+		for (int32_t by = 0; by < blocks_y; ++by)
+		{
+			for (int32_t bx = 0; bx < blocks_x; ++bx, blocks += 8)
+			{
+				const uint16_t color0 = uint16_t(blocks[0] | (blocks[1] << 8));
+				const uint16_t color1 = uint16_t(blocks[2] | (blocks[3] << 8));
+				const uint32_t indices = uint32_t(blocks[4]) | (uint32_t(blocks[5]) << 8)
+					| (uint32_t(blocks[6]) << 16) | (uint32_t(blocks[7]) << 24);
+
+				const int32_t red0 = red565(color0);
+				const int32_t red1 = red565(color1);
+
+				int32_t palette[4] = { red0, red1, 0, 0 };
+				if (color0 > color1) {
+					palette[2] = (2 * red0 + red1) / 3;
+					palette[3] = (red0 + 2 * red1) / 3;
+				}
+				else {
+					palette[2] = (red0 + red1) / 2;
+				}
+
+				for (int32_t ti = 0; ti < 16; ++ti)
+				{
+					const int32_t x = bx * 4 + (ti & 3);
+					const int32_t y = by * 4 + (ti >> 2);
+					if (x < bitmap.mWidth && y < bitmap.mHeight) {
+						bitmap.mTexels[size_t(y) * size_t(bitmap.mWidth) + size_t(x)] =
+							uint8_t(palette[(indices >> (2 * ti)) & 3]);
+					}
+				}
+			}
+		}
+	}
+
+	Bitmap loadAtlas(const char* filename)
+	{
+		gli::texture2D texture(gli::load(filename));
+		if (texture.empty()) {
+			throw std::runtime_error(fmt::format("Cannot load atlas {}\n", filename));
+		}
+
+		Bitmap bitmap;
+		bitmap.mWidth = texture.dimensions().x;
+		bitmap.mHeight = texture.dimensions().y;
+		bitmap.mTexels.assign(size_t(bitmap.mWidth) * size_t(bitmap.mHeight), 0);
+
+		const uint8_t* data = static_cast<const uint8_t*>(texture.data(0, 0, 0));
+		switch (texture.format())
+		{
+		case gli::FORMAT_RGB_DXT1_UNORM_BLOCK8:
+		case gli::FORMAT_RGBA_DXT1_UNORM_BLOCK8:
+			decodeBC1(data, bitmap);
+			break;
+		case gli::FORMAT_R8_UNORM_PACK8:
+			memcpy(bitmap.mTexels.data(), data, bitmap.mTexels.size());
+			break;
+		case gli::FORMAT_RGBA8_UNORM_PACK8:
+			for (size_t ti = 0; ti < bitmap.mTexels.size(); ++ti) {
+				bitmap.mTexels[ti] = data[ti * 4];
+			}
+			break;
+		default:
+			throw std::runtime_error(fmt::format("Unsupported atlas format {}\n", int32_t(texture.format())));
+		}
+
+		return bitmap;
+	}
+
+	// Signed distance, in source texels, from the centre of the given
+	// point to the closest texel of the other side of the glyph edge.
+	// Texels outside of the glyph rectangle count as empty.
+	float signedDistance(const Bitmap& atlas, const King::Glyph& glyph,
+		float x, float y, int32_t radius)
+	{
+		auto isInside = [&](int32_t tx, int32_t ty) {
+			return tx >= glyph.x && tx < glyph.x + glyph.width
+				&& ty >= glyph.y && ty < glyph.y + glyph.height
+				&& atlas.at(tx, ty) >= 128;
+		};
+
+		const int32_t cx = int32_t(std::floor(x));
+		const int32_t cy = int32_t(std::floor(y));
+		const bool inside = cx >= 0 && cx < atlas.mWidth && cy >= 0 && cy < atlas.mHeight && isInside(cx, cy);
+
+		float closest_sq = float(radius * radius);
+		for (int32_t ty = cy - radius; ty <= cy + radius; ++ty)
+		{
+			for (int32_t tx = cx - radius; tx <= cx + radius; ++tx)
+			{
+				const bool texel_inside = tx >= 0 && tx < atlas.mWidth
+					&& ty >= 0 && ty < atlas.mHeight && isInside(tx, ty);
+
+				if (texel_inside != inside)
+				{
+					const float dx = float(tx) + 0.5f - x;
+					const float dy = float(ty) + 0.5f - y;
+					closest_sq = std::min(closest_sq, dx * dx + dy * dy);
+				}
+			}
+		}
+
+		const float distance = std::sqrt(closest_sq);
+		return inside ? distance : -distance;
+	}
+
+	std::vector<uint8_t> buildDistanceField(const Bitmap& atlas,
+		int32_t width, int32_t height, int32_t downscale, int32_t spread)
+	{
+		// 0.5 is the edge, 0 and 1 are spread texels away on either side
+		std::vector<uint8_t> field(size_t(width) * size_t(height), 0);
+		const int32_t radius = spread * downscale;
+
+		for (const King::Glyph& glyph : King::Font)
+		{
+			if (glyph.width <= 0 || glyph.height <= 0) {
+				continue;
+			}
+
+			const int32_t first_x = glyph.x / downscale;
+			const int32_t first_y = glyph.y / downscale;
+			const int32_t last_x = std::min(width - 1, (glyph.x + glyph.width - 1) / downscale);
+			const int32_t last_y = std::min(height - 1, (glyph.y + glyph.height - 1) / downscale);
+
+			for (int32_t fy = first_y; fy <= last_y; ++fy)
+			{
+				for (int32_t fx = first_x; fx <= last_x; ++fx)
+				{
+					const float x = (float(fx) + 0.5f) * float(downscale);
+					const float y = (float(fy) + 0.5f) * float(downscale);
+					const float distance = signedDistance(atlas, glyph, x, y, radius);
+					const float value = std::min(std::max(0.5f + 0.5f * distance / float(radius), 0.f), 1.f);
+
+					// Texels shared by two glyphs keep the inner most value
+					uint8_t& texel = field[size_t(fy) * size_t(width) + size_t(fx)];
+					texel = std::max(texel, uint8_t(std::lround(value * 255.f)));
+				}
+			}
+		}
+
+		return field;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s <atlas.dds> <sdf_atlas.dds> [downscale] [spread]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	const int32_t downscale = argc > 3 ? atoi(argv[3]) : 4;
+	const int32_t spread = argc > 4 ? atoi(argv[4]) : 4;
+
+	try
+	{
+		if (downscale < 1 || spread < 1) {
+			throw std::runtime_error("Downscale and spread have to be positive\n");
+		}
+
+		const Bitmap atlas = loadAtlas(argv[1]);
+		if (atlas.mWidth != King::FONT_ATLAS_WIDTH || atlas.mHeight != King::FONT_ATLAS_HEIGHT) {
+			throw std::runtime_error(fmt::format("Atlas is {}x{}, the Font metrics expect {}x{}\n",
+				atlas.mWidth, atlas.mHeight, King::FONT_ATLAS_WIDTH, King::FONT_ATLAS_HEIGHT));
+		}
+
+		const int32_t width = atlas.mWidth / downscale;
+		const int32_t height = atlas.mHeight / downscale;
+		const std::vector<uint8_t> field = buildDistanceField(atlas, width, height, downscale, spread);
+
+		gli::texture2D texture(gli::FORMAT_R8_UNORM_PACK8, gli::texture2D::texelcoord_type(width, height), 1);
+		memcpy(texture.data(0, 0, 0), field.data(), field.size());
+
+		if (!gli::save_dds(texture, argv[2])) {
+			throw std::runtime_error(fmt::format("Cannot save {}\n", argv[2]));
+		}
+
+		printf("%s: %dx%d, %d texels spread\n", argv[2], width, height, spread);
+	}
+	catch (std::exception& e)
+	{
+		fprintf(stderr, "%s", e.what());
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}